@@ -75,6 +75,14 @@ struct gcc_compile_rule {
                 c += t;
             }
             c += "-MD";
+            if constexpr (requires { tgt.relocatable_outputs; }) {
+                if (tgt.relocatable_outputs) {
+                    // last matching option wins, binary dir may be inside source dir
+                    c += "-ffile-prefix-map=" + normalize_path(tgt.source_dir) + "=.";
+                    c += "-ffile-prefix-map=" + normalize_path(tgt.binary_dir) + "=bin";
+                    c.relocatable_outputs = true;
+                }
+            }
             tgt.bs.build_type.visit(
                     [&](build_type::debug) {
                         c += "-g", "-O0";
@@ -1137,10 +1145,11 @@ void detect_winsdk(auto &&s) {
     sdk.add_kits(s);
 }
 
-// maybe cache detected packages for subsequent calls? -sw1/-sw2
+// names are looked up in the persistent executable index, nothing is run or stat-ed here
 void detect_gcc_clang(auto &s) {
     auto detect = [&](auto &&prog, auto &&pkg, auto ... rules) {
-        if (auto p = resolve_executable(prog); !p.empty()) {
+        if (auto exe = resolve_executable(prog)) {
+            auto p = *exe;
             log_trace("detected compiler {}: {}", p, (string)pkg);
             s.add_entry_point(pkg, entry_point{[...rules = rules,prog,pkg,p](decltype(s) &s2) {
                 auto &t = s2.template add<executable_target>(pkg, native_library_target::raw_target_tag());
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "toolchain_cache.h"
 #include "vs_instance_helpers.h"
 //#include "../builtin/detect.h"
 
@@ -254,27 +255,58 @@ struct msvc_instance1 {
         return fs::exists(cl_exe(h,t));
     }
 
-    bool init(auto &&swctx) {
-        // check only this arch
-        auto n = get_windows_arch_name(swctx.sys.arch);
-        auto cl = cl_exe(n,n);
-        if (!fs::exists(cl)) {
-            return false;
-        }
+    void add(auto &&swctx, const path &cl) const {
         settings s;
         s["arch"] = arch_type{swctx.sys.arch};
         swctx.sys.packages[{"com.Microsoft.VisualStudio.VC.cl",vs_version}].emplace(std::move(s), cl_exe_rule1{cl,vs_version});
         //swctx.sys.packages[{"cl",vs_version}].emplace(std::move(s), cl_exe_rule1{cl,vs_version});
         //swctx.sys.packages[{"com.Microsoft.VisualStudio.VC.lib",vs_version}].emplace(std::move(s), cl_exe_rule1{prog("lib.exe"),vs_version});
         //swctx.sys.packages[{"com.Microsoft.VisualStudio.VC.link",vs_version}].emplace(std::move(s), cl_exe_rule1{prog("link.exe"),vs_version});
-        return true;
     }
 };
 
 struct msvc {
     std::vector<msvc_instance1> msvc;
 
+    // enumerating vs instances is slow, results are kept in storage_dir
     void detect(auto &&swctx) {
+        auto n = get_windows_arch_name(swctx.sys.arch);
+        toolchain_cache tc{swctx.storage_dir / "toolchains" / ("msvc."s + n + ".txt")};
+        if (!tc.load()) {
+            tc.clear();
+            probe(swctx, tc);
+            try {
+                tc.save();
+            } catch (std::exception &e) {
+                log_debug("cannot save detected toolchains: {}", e.what());
+            }
+        }
+        for (auto &&t : tc.toolchains) {
+            auto &i = msvc.emplace_back(t.root, package_version{package_version::number_version{t.version, t.extra}});
+            i.add(swctx, t.executable);
+        }
+    }
+    // vs installer keeps instance descriptions here, (un)installations change the dir
+    static path instances_dir() {
+        auto pd = getenv("ProgramData");
+        return path{pd ? pd : "C:/ProgramData"} / "Microsoft" / "VisualStudio" / "Packages" / "_Instances";
+    }
+    void probe(auto &&swctx, toolchain_cache &tc) {
+        tc.watch(instances_dir());
+        // in place updates rewrite state.json of the instance and do not change the dir
+        std::error_code ec;
+        for (auto &&e : fs::directory_iterator{instances_dir(), ec}) {
+            tc.watch(path{e.path()} / "state.json");
+        }
+        struct candidate {
+            path root;
+            string version;
+            string extra;
+            path cl;
+            bool found{};
+        };
+        std::vector<candidate> candidates;
+        auto n = get_windows_arch_name(swctx.sys.arch);
         auto instances = enumerate_vs_instances();
         for (auto &&i : instances) {
             path root = i.VSInstallLocation;
@@ -283,14 +315,23 @@ struct msvc {
                 // continue;
             }
             auto d = root / "VC" / "Tools" / "MSVC";
+            // new toolsets of this instance
+            tc.watch(d);
             for (auto &&p : fs::directory_iterator{d}) {
                 if (!package_version{p.path().filename().string()}.is_branch()) {
-                    msvc.emplace_back(d / p.path(), package_version{package_version::number_version{
-                                                        path{i.Version}.string(), preview ? "preview"s : ""s}});
-                    msvc.back().init(swctx);
+                    msvc_instance1 mi{d / p.path()};
+                    candidates.emplace_back(mi.root, path{i.Version}.string(), preview ? "preview"s : ""s, mi.cl_exe(n, n));
                 }
             }
         }
+        // toolsets are checked concurrently
+        parallel_for_each(candidates, [](auto &&c) {
+            c.found = stat_cache::global().is_regular_file(c.cl);
+        }, 1);
+        for (auto &&c : candidates) {
+            if (c.found) {
+                tc.add({"com.Microsoft.VisualStudio.VC.cl", c.version, c.extra, n, c.root, c.cl});
+            }
+        }
     }
 };
-
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "../helpers/common.h"
+
+// detected toolchains kept in storage_dir between runs
+// valid while all watched files and dirs keep their size and mtime,
+// so an unchanged machine is checked with a few stats instead of probing
+struct toolchain_cache {
+    static inline constexpr auto version = 2;
+
+    struct fingerprint {
+        path p;
+        uint64_t size{};
+        int64_t mtime{};
+
+        static fingerprint of(const path &p) {
+            auto s = stat_cache::global().get(p);
+            return {p, s.size, s.mtime.time_since_epoch().count()};
+        }
+        bool operator==(const fingerprint &) const = default;
+    };
+    struct toolchain {
+        string package;
+        // number part and pre-release suffix, like '17.4.33' and 'preview'
+        string version;
+        string extra;
+        string target;
+        path root;
+        path executable;
+    };
+
+    path fn;
+    std::vector<fingerprint> watched;
+    std::vector<toolchain> toolchains;
+
+    toolchain_cache(const path &fn) : fn{fn} {
+    }
+
+    void watch(const path &p) {
+        watched.push_back(fingerprint::of(p));
+    }
+    // executables are watched too
+    void add(toolchain t) {
+        watch(t.executable);
+        toolchains.push_back(std::move(t));
+    }
+
+    bool load() {
+        auto s = read_file(fn);
+        line_reader r{s};
+        int ver{};
+        size_t n{};
+        if (!r.number(ver) || ver != version || !r.number(n)) {
+            return false;
+        }
+        while (n--) {
+            auto &f = watched.emplace_back();
+            auto p = r.line();
+            if (!p || !r.number(f.size) || !r.number(f.mtime)) {
+                return false;
+            }
+            f.p = string{*p};
+            if (fingerprint::of(f.p) != f) {
+                return false;
+            }
+        }
+        if (!r.number(n)) {
+            return false;
+        }
+        while (n--) {
+            auto &t = toolchains.emplace_back();
+            for (auto v : {&t.package, &t.version, &t.extra, &t.target}) {
+                auto l = r.line();
+                if (!l) {
+                    return false;
+                }
+                *v = *l;
+            }
+            auto root = r.line();
+            auto exe = r.line();
+            if (!root || !exe) {
+                return false;
+            }
+            t.root = string{*root};
+            t.executable = string{*exe};
+        }
+        return true;
+    }
+    void save() const {
+        auto s = std::format("{}\n{}\n", version, watched.size());
+        for (auto &&f : watched) {
+            s += std::format("{}\n{}\n{}\n", f.p.string(), f.size, f.mtime);
+        }
+        s += std::format("{}\n", toolchains.size());
+        for (auto &&t : toolchains) {
+            s += std::format("{}\n{}\n{}\n{}\n{}\n{}\n", t.package, t.version, t.extra, t.target, t.root.string(),
+                             t.executable.string());
+        }
+        write_file(fn, s);
+    }
+    void clear() {
+        watched.clear();
+        toolchains.clear();
+    }
+};
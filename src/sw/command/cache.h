@@ -0,0 +1,588 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "command.h"
+#include "../sys/socket.h"
+
+namespace sw {
+
+// directory backed content addressable storage
+//  ac/xx/<key>     - action results (manifests)
+//  cas/xx/<digest> - blobs
+struct cache_store {
+    path root;
+
+    static auto file_digest(const path &fn) {
+        crypto::sha3<256> h;
+        mmap_file<uint8_t>::for_each_window(fn, [&](auto p, auto n) {
+            h.update(p, n);
+        });
+        return bytes_to_string(h.digest());
+    }
+    static auto is_digest(string_view d) {
+        return d.size() == 64 && std::ranges::all_of(d, [](auto c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+        });
+    }
+
+    path manifest_path(const string &key) const {
+        return root / "ac" / key.substr(0, 2) / key;
+    }
+    path blob_path(const string &d) const {
+        return root / "cas" / d.substr(0, 2) / d;
+    }
+    // several processes and server threads may store the same entry
+    static path tmp_path(const path &fn) {
+        static std::atomic_uint64_t n;
+        return path{fn} += std::format(".{:x}.{}.tmp", std::chrono::steady_clock::now().time_since_epoch().count(), ++n);
+    }
+
+    std::optional<string> get_manifest(const string &key) const {
+        auto fn = manifest_path(key);
+        if (!fs::exists(fn)) {
+            return {};
+        }
+        return read_file(fn);
+    }
+    // write_file replaces the target atomically
+    void put_manifest(const string &key, const string &m) const {
+        write_file(manifest_path(key), m);
+    }
+    bool has_blob(const string &d) const {
+        return fs::exists(blob_path(d));
+    }
+    // copy keeps permissions (linked executables)
+    void get_blob(const string &d, const path &to) const {
+        fs::create_directories(to.parent_path());
+        auto tmp = path{to} += ".sw.tmp";
+        fs::copy_file(blob_path(d), tmp, fs::copy_options::overwrite_existing);
+        fs::rename(tmp, to);
+    }
+    void put_blob(const string &d, const path &from) const {
+        auto fn = blob_path(d);
+        if (fs::exists(fn)) {
+            return;
+        }
+        fs::create_directories(fn.parent_path());
+        auto tmp = tmp_path(fn);
+        fs::copy_file(from, tmp, fs::copy_options::overwrite_existing);
+        fs::rename(tmp, fn);
+    }
+    auto put_blob_data(const string &data) const {
+        auto d = digest<crypto::sha3<256>>(data);
+        if (!has_blob(d)) {
+            write_file(blob_path(d), data);
+        }
+        return d;
+    }
+    string get_blob_data(const string &d) const {
+        return read_file(blob_path(d));
+    }
+};
+
+// remote cache protocol, one request per line, sizes are in bytes
+//  get-ac <key>                     -> ok <size>\n<data> | miss
+//  put-ac <key> <size>\n<data>      -> ok
+//  has-blob <digest>                -> ok 0 | miss
+//  get-blob <digest>                -> ok <size>\n<data> | miss
+//  put-blob <digest> <size>\n<data> -> ok (digest of data is verified)
+// any other reply is 'error <text>'
+// the protocol is not authenticated and not encrypted, use it on trusted networks only
+struct remote_cache {
+    string address;
+    socket_stream s;
+
+    remote_cache(const string &address) : address{address} {}
+
+    std::optional<string> request(const string &req, const string *data = nullptr) {
+        if (!s) {
+            s = socket_stream::connect(address);
+        }
+        s.write(req + "\n");
+        if (data) {
+            s.write(*data);
+        }
+        auto l = s.read_line();
+        if (!l) {
+            throw std::runtime_error{"connection closed"};
+        }
+        if (*l == "miss") {
+            return {};
+        }
+        if (*l == "ok") {
+            return string{};
+        }
+        if (l->starts_with("ok ")) {
+            return s.read(std::stoull(l->substr(3)));
+        }
+        throw std::runtime_error{"remote cache: " + *l};
+    }
+    auto get_manifest(const string &key) {
+        return request("get-ac " + key);
+    }
+    void put_manifest(const string &key, const string &m) {
+        request(std::format("put-ac {} {}", key, m.size()), &m);
+    }
+    bool has_blob(const string &d) {
+        return request("has-blob " + d).has_value();
+    }
+    auto get_blob(const string &d) {
+        return request("get-blob " + d);
+    }
+    void put_blob(const string &d, const string &data) {
+        request(std::format("put-blob {} {}", d, data.size()), &data);
+    }
+};
+
+// caches results of io commands, so outputs are restored instead of running the command
+//
+// key = command hash + explicit input contents + program identity
+// manifest stores implicit inputs with their digests (deps are known only after the run),
+// outputs and captured stdout/stderr
+struct action_cache {
+    static inline constexpr auto manifest_version = "sw-ac 1"sv;
+
+    struct manifest {
+        std::vector<std::pair<path, string>> implicit_inputs;
+        std::vector<std::pair<path, string>> outputs;
+        string out, err, text;
+
+        // paths are stored relative to known roots
+        void map_paths(auto &&f) {
+            for (auto &&[p, _] : implicit_inputs) {
+                p = f(p.string());
+            }
+            for (auto &&[p, _] : outputs) {
+                p = f(p.string());
+            }
+        }
+        auto blobs() const {
+            std::vector<string> v;
+            for (auto &&[_, d] : outputs) {
+                v.push_back(d);
+            }
+            v.push_back(out);
+            v.push_back(err);
+            v.push_back(text);
+            return v;
+        }
+        string to_string() const {
+            string s{manifest_version};
+            s += "\n";
+            for (auto &&[f, d] : implicit_inputs) {
+                s += "i " + d + " " + f.string() + "\n";
+            }
+            for (auto &&[f, d] : outputs) {
+                s += "o " + d + " " + f.string() + "\n";
+            }
+            s += "1 " + out + "\n";
+            s += "2 " + err + "\n";
+            s += "t " + text + "\n";
+            return s;
+        }
+        static std::optional<manifest> parse(string_view s) {
+            manifest m;
+            auto p = s.find('\n');
+            if (s.substr(0, p) != manifest_version) {
+                return {};
+            }
+            s = s.substr(p + 1);
+            while (!s.empty()) {
+                p = s.find('\n');
+                if (p == -1 || p < 2 + 64 || s[1] != ' ') {
+                    return {};
+                }
+                auto line = s.substr(0, p);
+                s = s.substr(p + 1);
+                auto d = string{line.substr(2, 64)};
+                if (!cache_store::is_digest(d)) {
+                    return {};
+                }
+                auto f = line.size() > 2 + 64 + 1 ? path{string{line.substr(2 + 64 + 1)}} : path{};
+                switch (line[0]) {
+                case 'i': m.implicit_inputs.emplace_back(f, d); break;
+                case 'o': m.outputs.emplace_back(f, d); break;
+                case '1': m.out = d; break;
+                case '2': m.err = d; break;
+                case 't': m.text = d; break;
+                default: return {};
+                }
+            }
+            return m;
+        }
+    };
+
+    cache_store local;
+    // optional shared cache, consulted on local misses
+    std::optional<remote_cache> remote;
+    // file contents do not change during the build except for outputs of running commands
+    std::unordered_map<path, std::optional<string>> digests;
+    size_t hits{};
+    size_t misses{};
+
+    action_cache(const path &root) : local{root} {}
+
+    std::optional<string> file_digest(const path &f) {
+        auto [it, inserted] = digests.try_emplace(f);
+        if (inserted && stat_cache::global().is_regular_file(f)) {
+            it->second = cache_store::file_digest(f);
+        }
+        return it->second;
+    }
+    void invalidate(auto &&c) {
+        for (auto &&o : c.outputs) {
+            digests.erase(o);
+        }
+    }
+
+    static const path_roots &roots(auto &&c) {
+        static const path_roots empty;
+        return c.cs ? c.cs->roots : empty;
+    }
+    static bool is_cacheable(auto &&c) {
+        // implicit inputs of cl.exe are added after the completion callback
+        if constexpr (std::same_as<std::decay_t<decltype(c)>, cl_exe_command>) {
+            return false;
+        } else {
+            return !c.always && !c.outputs.empty() && !c.is_pipe_leader() && !c.is_pipe_child() &&
+                   !std::holds_alternative<string>(c.in.s);
+        }
+    }
+    std::optional<string> key(auto &&c) {
+        crypto::sha3<256> h;
+        auto add = [&](const string &s) {
+            h.update(s);
+            h.update("\n");
+        };
+        // command hash has roots replaced, outputs of other commands may contain the real ones
+        auto normalize = [&](const path &p) {
+            return c.relocatable_outputs ? roots(c).normalize(p.string()) : p.string();
+        };
+        add(c.hash().to_string());
+        if (!c.relocatable_outputs) {
+            for (auto &&[root, _] : roots(c).roots) {
+                add(root);
+            }
+        }
+        for (auto &&f : c.inputs) {
+            auto d = file_digest(f);
+            if (!d) {
+                return {};
+            }
+            add(normalize(f));
+            add(*d);
+        }
+        // program identity, hashing compilers on every build is too expensive
+        if (!c.arguments.empty()) {
+            auto prog = visit(c.arguments[0], [](const path &p) {
+                return p;
+            }, [](auto &&s) {
+                return path{string{s}};
+            });
+            if (auto st = stat_cache::global().get(prog); st.is_regular_file()) {
+                add(normalize(prog));
+                add(std::to_string(st.size));
+                add(std::to_string(st.mtime.time_since_epoch().count()));
+            }
+        }
+        return bytes_to_string(h.digest());
+    }
+
+    // cache errors must not break the build, they are misses
+    bool restore(auto &&c) {
+        try {
+            return restore1(c);
+        } catch (std::exception &e) {
+            log_debug("cannot restore from cache: {}: {}", c.name(), e.what());
+            return false;
+        }
+    }
+    void store(auto &&c) {
+        try {
+            store1(c);
+        } catch (std::exception &e) {
+            log_debug("cannot store to cache: {}: {}", c.name(), e.what());
+        }
+    }
+    bool restore1(auto &&c) {
+        if (!is_cacheable(c)) {
+            return false;
+        }
+        auto k = key(c);
+        if (!k) {
+            return false;
+        }
+        auto m = load(*k, roots(c));
+        if (!m || !check(*m, c.outputs)) {
+            m = fetch(*k, roots(c), c.outputs);
+            if (!m || !check(*m, c.outputs)) {
+                ++misses;
+                return false;
+            }
+        }
+        // blobs are written to outputs of the command only, not to paths from the manifest
+        for (auto &&f : c.outputs) {
+            auto it = std::ranges::find(m->outputs, f, [](auto &&o) -> const path & {
+                return o.first;
+            });
+            local.get_blob(it->second, f);
+        }
+        invalidate(c);
+        for (auto &&[f, _] : m->implicit_inputs) {
+            c.implicit_inputs.insert(f);
+        }
+        if (auto s = std::get_if<string>(&c.out.s)) {
+            *s = local.get_blob_data(m->out);
+        }
+        if (auto s = std::get_if<string>(&c.err.s)) {
+            *s = local.get_blob_data(m->err);
+        }
+        c.out_text = local.get_blob_data(m->text);
+        c.exit_code = 0;
+        ++hits;
+        return true;
+    }
+    void store1(auto &&c) {
+        invalidate(c);
+        if (!is_cacheable(c) || !c.ok()) {
+            return;
+        }
+        auto k = key(c);
+        if (!k) {
+            return;
+        }
+        manifest m;
+        bool ok = true;
+        auto add_implicit = [&](const path &f) {
+            auto d = file_digest(f);
+            if (!d) {
+                ok = false;
+                return;
+            }
+            m.implicit_inputs.emplace_back(roots(c).normalize(f.string()), *d);
+        };
+        for (auto &&f : c.implicit_inputs) {
+            add_implicit(f);
+        }
+        for (auto &&id : c.implicit_input_ids) {
+            add_implicit(command_storage::global_fs[id].f);
+        }
+        if (!ok) {
+            return;
+        }
+        for (auto &&f : c.outputs) {
+            auto d = file_digest(f);
+            if (!d) {
+                return;
+            }
+            local.put_blob(*d, f);
+            m.outputs.emplace_back(roots(c).normalize(f.string()), *d);
+        }
+        auto s = [](auto &&stream) {
+            auto s = std::get_if<string>(&stream.s);
+            return s ? *s : string{};
+        };
+        m.out = local.put_blob_data(s(c.out));
+        m.err = local.put_blob_data(s(c.err));
+        m.text = local.put_blob_data(c.out_text);
+        local.put_manifest(*k, m.to_string());
+        push(*k, m);
+    }
+
+    std::optional<manifest> load(const string &key, const path_roots &r) {
+        auto s = local.get_manifest(key);
+        if (!s) {
+            return {};
+        }
+        auto m = manifest::parse(*s);
+        if (m) {
+            m->map_paths([&](auto &&p) {
+                return r.expand(p);
+            });
+        }
+        return m;
+    }
+    // manifest has exactly the outputs of the command, so a bad or colliding entry
+    // cannot write files the command does not own
+    static bool same_outputs(const manifest &m, const std::set<path> &outputs) {
+        std::set<path> s;
+        for (auto &&[f, _] : m.outputs) {
+            s.insert(f);
+        }
+        return s.size() == m.outputs.size() && s == outputs;
+    }
+    // outputs and implicit inputs are the same and all blobs are present
+    bool check(const manifest &m, const std::set<path> &outputs) {
+        if (!same_outputs(m, outputs)) {
+            return false;
+        }
+        for (auto &&[f, d] : m.implicit_inputs) {
+            if (file_digest(f) != d) {
+                return false;
+            }
+        }
+        return std::ranges::all_of(m.blobs(), [&](auto &&d) {
+            return local.has_blob(d);
+        });
+    }
+
+    // remote errors disable it for the rest of the build
+    void with_remote(auto &&f) {
+        if (!remote) {
+            return;
+        }
+        try {
+            f(*remote);
+        } catch (std::exception &e) {
+            log_warn("remote cache is disabled: {}", e.what());
+            remote.reset();
+        }
+    }
+    // downloads the manifest and missing blobs into the local store
+    std::optional<manifest> fetch(const string &key, const path_roots &roots, const std::set<path> &outputs) {
+        std::optional<manifest> m;
+        with_remote([&](auto &&r) {
+            auto s = r.get_manifest(key);
+            if (!s) {
+                return;
+            }
+            auto m1 = manifest::parse(*s);
+            if (!m1) {
+                return;
+            }
+            m1->map_paths([&](auto &&p) {
+                return roots.expand(p);
+            });
+            if (!same_outputs(*m1, outputs)) {
+                return;
+            }
+            // do not download outputs of stale entries
+            for (auto &&[f, d] : m1->implicit_inputs) {
+                if (file_digest(f) != d) {
+                    return;
+                }
+            }
+            for (auto &&d : m1->blobs()) {
+                if (!local.has_blob(d)) {
+                    auto b = r.get_blob(d);
+                    if (!b || local.put_blob_data(*b) != d) {
+                        return;
+                    }
+                }
+            }
+            local.put_manifest(key, *s);
+            m = std::move(m1);
+        });
+        return m;
+    }
+    void push(const string &key, const manifest &m) {
+        with_remote([&](auto &&r) {
+            for (auto &&d : m.blobs()) {
+                if (!r.has_blob(d)) {
+                    r.put_blob(d, local.get_blob_data(d));
+                }
+            }
+            r.put_manifest(key, m.to_string());
+        });
+    }
+};
+
+// reference server, stores everything in a cache_store
+// there is no authentication, anyone who can connect may read and write the cache,
+// so listen on a unix socket or loopback, or put it behind something that checks clients
+struct cache_server {
+    // requests declare sizes of their data, larger requests drop the connection
+    static inline constexpr uint64_t max_blob_size = 1ULL << 30;
+    static inline constexpr uint64_t max_manifest_size = 16 * 1024 * 1024;
+    // connections served at once, others wait in the listen queue
+    static inline constexpr auto max_connections = 64;
+
+    cache_store store;
+
+    void run(const string &address) {
+        socket_listener l{address};
+        log_info("cache server is listening on {}, storage: {}", address, store.root);
+        // fixed pool of workers, each accepts and serves one connection at a time
+        std::mutex m;
+        std::exception_ptr err;
+        {
+            std::vector<std::jthread> workers;
+            for (int i = 0; i < max_connections; ++i) {
+                workers.emplace_back([&] {
+                    try {
+                        while (true) {
+                            auto s = l.accept();
+                            serve(s);
+                        }
+                    } catch (std::exception &e) {
+                        log_warn("cache server: {}", e.what());
+                        std::unique_lock lk{m};
+                        if (!err) {
+                            err = std::current_exception();
+                        }
+                    }
+                });
+            }
+        }
+        std::rethrow_exception(err);
+    }
+    void serve(socket_stream &s) {
+        try {
+            while (auto l = s.read_line()) {
+                s.write(handle(s, *l));
+            }
+        } catch (std::exception &e) {
+            log_debug("cache server: {}", e.what());
+        }
+    }
+    string handle(socket_stream &s, const string &line) {
+        std::vector<string> w;
+        for (auto &&p : std::views::split(line, ' ')) {
+            w.emplace_back(p.begin(), p.end());
+        }
+        if (w.size() < 2 || !cache_store::is_digest(w[1])) {
+            return "error bad request\n";
+        }
+        auto &verb = w[0];
+        auto &arg = w[1];
+        auto reply = [](const string &data) {
+            return std::format("ok {}\n", data.size()) + data;
+        };
+        // data that is not read cannot be skipped, so errors here close the connection
+        auto read_data = [&](uint64_t max_size) {
+            if (w.size() != 3) {
+                throw std::runtime_error{"bad request: " + line};
+            }
+            auto n = std::stoull(w[2]);
+            if (n > max_size) {
+                throw std::runtime_error{std::format("request is too large: {} bytes", n)};
+            }
+            return s.read(n);
+        };
+        if (verb == "get-ac") {
+            auto m = store.get_manifest(arg);
+            return m ? reply(*m) : "miss\n";
+        } else if (verb == "put-ac") {
+            auto m = read_data(max_manifest_size);
+            if (!action_cache::manifest::parse(m)) {
+                return "error bad manifest\n";
+            }
+            store.put_manifest(arg, m);
+            return "ok\n";
+        } else if (verb == "has-blob") {
+            return store.has_blob(arg) ? "ok 0\n" : "miss\n";
+        } else if (verb == "get-blob") {
+            return store.has_blob(arg) ? reply(store.get_blob_data(arg)) : "miss\n";
+        } else if (verb == "put-blob") {
+            if (store.put_blob_data(read_data(max_blob_size)) != arg) {
+                return "error digest mismatch\n";
+            }
+            return "ok\n";
+        }
+        return "error unknown request\n";
+    }
+};
+
+} // namespace sw
@@ -3,12 +3,20 @@
 
 #pragma once
 
+#include "deps.h"
 #include "unix.h"
 #include "win32.h"
 
 #include "../helpers/json.h"
+#include "../sys/file_lock.h"
 #include "../sys/log.h"
 
+#include <shared_mutex>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
+
 #ifdef __GNUC__
 // not yet in libstdc++
 template <>
@@ -29,39 +37,126 @@ struct command_pointer_holder {
     io_command *io;
 };
 
+// replaces known roots (source, binary, storage dirs) with placeholders,
+// so keys do not depend on where the project is checked out
+struct path_roots {
+    // longest roots go first, nested dirs must be replaced before their parents
+    std::vector<std::pair<string, string>> roots;
+
+    void add(const path &root, const string &placeholder) {
+        if (root.empty()) {
+            return;
+        }
+        roots.emplace_back(normalize_path(root), placeholder);
+        std::ranges::stable_sort(roots, std::greater{}, [](auto &&r) {
+            return r.first.size();
+        });
+    }
+    // whole_path: from must be followed by a separator or something that ends a path in arguments
+    // (-ffile-prefix-map=root=.), so /a/proj does not match /a/proj2
+    static string replace(string_view s, auto &&from, auto &&to, bool whole_path = false) {
+        string r;
+        size_t p, start = 0;
+        while ((p = s.find(from, start)) != -1) {
+            auto e = p + from.size();
+            if (whole_path && e < s.size() && !string_view{"/\\=;:,\"' "}.contains(s[e])) {
+                start = p + 1;
+                continue;
+            }
+            r += s.substr(0, p);
+            r += to;
+            s = s.substr(e);
+            start = 0;
+        }
+        r += s;
+        return r;
+    }
+    string normalize(string_view s) const {
+        string r{s};
+        for (auto &&[root, ph] : roots) {
+            if (r.contains(root)) {
+                r = replace(r, root, ph, true);
+            }
+        }
+        return r;
+    }
+    string expand(string_view s) const {
+        string r{s};
+        for (auto &&[root, ph] : roots) {
+            if (r.contains(ph)) {
+                r = replace(r, ph, root);
+            }
+        }
+        return r;
+    }
+};
+
+// stable across platforms and std libs, so dbs and caches can be shared
 struct command_hash {
     struct hasher {
         auto operator()(const command_hash &h) const {
-            return h.h;
+            return (size_t)h.h[0];
         }
     };
 
-    uint64_t h{0};
+    std::array<uint64_t, 2> h{};
 
     void operator()(auto &&cmd) {
-        h = 0;
+        const path_roots *roots{};
+        if constexpr (requires { cmd.cs->roots; }) {
+            if (cmd.cs) {
+                roots = &cmd.cs->roots;
+            }
+        }
+        crypto::shake<128, 128> s;
+        // every field is tagged and length prefixed,
+        // so order, duplicates and field boundaries change the hash
+        auto add = [&](uint8_t tag, std::string_view v0) {
+            string n;
+            if (roots) {
+                n = roots->normalize(v0);
+            }
+            std::string_view v = roots ? n : v0;
+            uint8_t hdr[9]{tag};
+            for (int i = 0; i < 8; ++i) {
+                hdr[i + 1] = (uint64_t)v.size() >> (i * 8);
+            }
+            s.update(hdr, sizeof(hdr));
+            s.update((const uint8_t *)v.data(), v.size());
+        };
         for (auto &&a : cmd.arguments) {
-            visit(a, [&]<typename T>(const T &s) {
-                h ^= std::hash<T>()(s);
+            visit(a, [&](const path &p) {
+                add('a', p.string());
+            }, [&](auto &&s) {
+                add('a', s);
             });
         }
-        h ^= std::hash<path>()(cmd.working_directory);
+        add('w', cmd.working_directory.string());
         for (auto &&[k, v] : cmd.environment) {
-            h ^= std::hash<string>()(k);
-            h ^= std::hash<string>()(v);
+            add('k', k);
+            add('v', v);
         }
         if (auto p = std::get_if<path>(&cmd.in.s)) {
-            h ^= std::hash<path>()(*p);
+            add('<', p->string());
         }
         if (auto p = std::get_if<path>(&cmd.out.s)) {
-            h ^= std::hash<path>()(*p);
+            add('>', p->string());
         }
         if (auto p = std::get_if<path>(&cmd.err.s)) {
-            h ^= std::hash<path>()(*p);
+            add('2', p->string());
+        }
+        auto d = s.digest();
+        for (int i = 0; i < 2; ++i) {
+            h[i] = 0;
+            for (int j = 0; j < 8; ++j) {
+                h[i] |= (uint64_t)d[i * 8 + j] << (j * 8);
+            }
         }
     }
-    explicit operator bool() const { return h; }
-    operator auto() const { return h; }
+    explicit operator bool() const { return h[0] || h[1]; }
+    string to_string() const {
+        return std::format("{:016x}{:016x}", h[1], h[0]);
+    }
     auto operator<=>(const command_hash &) const = default;
 };
 
@@ -79,48 +174,73 @@ struct command_storage {
     struct new_file { const path *p; };
     struct missing_file { const path *p; };
     // struct not_regular_file {};
-    struct updated_file { const path *p; };
+    struct updated_file { const path *p; time_point mtime, command_mtime; };
     using outdated_reason = variant<not_outdated, new_command, new_file, not_recorded_file, missing_file, updated_file>;
 
+    // dense index into the shared path table
+    using file_id = uint32_t;
+
+    using digest_type = std::array<uint64_t, 2>;
+    // for early cutoff: when rerun command produces the same output, old mtime is restored
+    // records keep it as is with zeroed padding after f, see serialize()
+    struct output_data {
+        file_id f;
+        time_point mtime;
+        digest_type digest;
+    };
+    static_assert(offsetof(output_data, mtime) == 8 && sizeof(output_data) == 32);
     struct command_data {
         time_point mtime;
+        // how long the last run took, for estimates
+        clock::duration duration{};
         //io_command::hash_type hash;
-        std::unordered_set<uint64_t> files;
+        std::vector<file_id> files;
+        std::vector<output_data> outputs;
     };
     struct file_storage {
         struct file {
+            static inline constexpr auto unchecked = (std::numeric_limits<int64_t>::min)();
+            static inline constexpr auto missing = unchecked + 1;
+
             path f;
-            mutable time_point mtime{};
-            bool checked{false};
-            bool exists{false};
-
-            void check() {
-                // GetFileAttributesExW
-                auto s = fs::status(f);
-                exists = fs::exists(s);
-                if (exists) {
-                    auto lwt = fs::last_write_time(f);
-#ifdef _MSC_VER
-                    mtime = std::chrono::clock_cast<std::chrono::system_clock>(lwt);
-#else
-                    //mtime = lwt;
-                    //mtime = std::chrono::clock_cast<std::chrono::system_clock>(lwt);
-#if defined(__MINGW32__) || defined(__APPLE__)
-                    mtime = decltype(lwt)::clock::to_sys(lwt);
-#else
-                    mtime = decltype(lwt)::clock::to_sys(lwt);
-#endif
-#endif
-                }
-                checked = true;
+            // mtime or one of the values above, outdated checks run on worker threads
+            std::atomic<int64_t> state{unchecked};
+
+            file(const path &f) : f{f} {
+            }
+
+            bool checked() const {
+                return state != unchecked;
+            }
+            bool exists() const {
+                auto s = state.load();
+                return s != unchecked && s != missing;
+            }
+            time_point mtime() const {
+                return time_point{clock::duration{state.load()}};
+            }
+            void set_mtime(const time_point &t) {
+                state = t.time_since_epoch().count();
+            }
+            void reset() {
+                state = unchecked;
+            }
+            int64_t check() {
+                // shared with other filesystem queries of this build
+                auto s = stat_cache::global().get(f);
+                auto v = s.exists() ? s.mtime.time_since_epoch().count() : missing;
+                state = v;
+                return v;
             }
             outdated_reason is_outdated(const time_point &command_time) {
-                if (!checked) {
-                    check();
+                auto s = state.load();
+                if (s == unchecked) {
+                    s = check();
                 }
-                if (!exists) {
+                if (s == missing) {
                     return missing_file{&f};
                 }
+                auto mtime = time_point{clock::duration{s}};
                 /*if (!fs::is_regular_file(s)) {
                     std::cerr << "outdated: not regular file" << "\n";
                     return true;
@@ -130,126 +250,988 @@ struct command_storage {
     #else
                 if (mtime.time_since_epoch() > command_time.time_since_epoch()) {
     #endif
-                    return updated_file{&f};
+                    return updated_file{&f, mtime, command_time};
                 }
                 return {};
             }
         };
-        using hash_type = uint64_t;
+        using mmap_type = mmap_file<>;
 
-        std::unordered_map<hash_type, file> files;
+        // one table per build dir, shared by all command dbs
+        // index in files is the id of the path
+        std::deque<file> files;
+        // allows lookups by string_view without constructing paths
+        struct path_hash {
+            using is_transparent = void;
+            static std::string_view sv(const path &p) {
+                return p.string();
+            }
+            static std::string_view sv(std::string_view s) {
+                return s;
+            }
+            size_t operator()(const auto &p) const {
+                return std::hash<std::string_view>{}(sv(p));
+            }
+            bool operator()(const auto &a, const auto &b) const {
+                return sv(a) == sv(b);
+            }
+        };
+        std::unordered_map<path, file_id, path_hash, path_hash> ids;
+        path fn;
+        mmap_type f_files;
+        mmap_type::stream files_stream;
+        mmap_type::record_writer files_writer;
+        // dbs are opened and deps are interned from several threads
+        // files is a deque, so references by id stay valid while it grows,
+        // but its block map is reallocated, so lookups by id take the shared lock
+        std::shared_mutex m;
+        // ids are positions in files.bin, so only one process may add paths at a time
+        // the lease is taken on the first new path and released on flush
+        file_lock lock;
+        bool leased{};
+        // processes keep ids in memory, so each one holds a shared lock on it while the table is open
+        // and the table is compacted only by a process that gets it exclusively
+        file_lock users;
+        // db dirs using this table, kept in dbs.txt for compaction
+        std::set<string> dbs;
+        // build -n: new paths get ids in memory only, nothing is written
+        bool read_only{};
 
         file_storage() {
-            files.reserve(100'000);
+            ids.reserve(100'000);
+        }
+        void open(const path &dir) {
+            std::unique_lock lk{m};
+            if (!fn.empty()) {
+                return;
+            }
+            if (!files.empty()) {
+                throw std::logic_error{"path table must be opened before first use"};
+            }
+            fn = dir / "files.bin";
+            users.open(dir / "files.users");
+            users.lock_shared();
+            lock.open(dir / "files.lock");
+            std::unique_lock fl{lock};
+            recover();
+            read_dbs();
+            f_files.open(fn, mmap_type::rw{});
+            files_stream = f_files.get_stream();
+            files_writer.s = &files_stream;
+            sync();
+            if (files_stream.torn) {
+                log_warn("{}: discarded incomplete record after {} entries", fn, files.size());
+            }
+        }
+        path dir() const {
+            return fn.parent_path();
+        }
+        path journal_path() const {
+            return dir() / "files.compact";
+        }
+        // under the lock
+        // finishes compaction that was interrupted after its journal had been written,
+        // the journal lists dbs rewritten with new ids
+        void recover() {
+            auto j = journal_path();
+            if (!fs::exists(j)) {
+                return;
+            }
+            log_warn("{}: finishing interrupted compaction", fn);
+            std::error_code ec;
+            bool ok = true;
+            if (auto tmp = path{fn} += ".new"; fs::exists(tmp)) {
+                fs::rename(tmp, fn, ec);
+                ok &= !ec;
+            }
+            auto s = read_file(j);
+            line_reader r{s};
+            while (auto l = r.line()) {
+                path d{string{*l}};
+                if (!fs::exists(d / "commands.bin.new")) {
+                    continue;
+                }
+                file_lock dl{d / "commands.lock"};
+                std::unique_lock lk{dl};
+                if (fs::remove(d / "commands.idx", ec), !ec) {
+                    fs::rename(d / "commands.bin.new", d / "commands.bin", ec);
+                }
+                ok &= !ec;
+                dl.set_generation(dl.generation() + 1);
+            }
+            if (ok) {
+                fs::remove(j, ec);
+            }
+        }
+        // under the lock
+        void read_dbs() {
+            auto s = read_file(dir() / "dbs.txt");
+            line_reader r{s};
+            while (auto l = r.line()) {
+                dbs.emplace(*l);
+            }
+        }
+        void write_dbs() {
+            string s;
+            for (auto &&d : dbs) {
+                s += d + "\n";
+            }
+            write_file(dir() / "dbs.txt", s);
         }
-        void add(auto &&f, auto &&files_stream, auto &&fs, bool reset) {
-            auto [it, _] = files.emplace(std::hash<path>()(f), f);
-            auto [_2, inserted2] = fs.insert(&it->second);
-            if (inserted2) {
-                files_stream << f;
+        void register_db(const path &db) {
+            std::unique_lock lk{m};
+            if (fn.empty() || read_only || dbs.contains(db.string())) {
+                return;
+            }
+            auto add = [&]() {
+                // others may have added theirs
+                read_dbs();
+                if (dbs.insert(db.string()).second) {
+                    write_dbs();
+                }
+            };
+            // the lease already holds the lock
+            if (leased) {
+                return add();
+            }
+            std::unique_lock fl{lock};
+            add();
+        }
+        // no other process keeps ids of this table in memory
+        bool try_exclusive_use() {
+            users.unlock();
+            if (users.try_lock()) {
+                return true;
+            }
+            // failed conversion drops the shared lock
+            users.lock_shared();
+            return false;
+        }
+        void shared_use() {
+            users.unlock();
+            users.lock_shared();
+        }
+        // under the lock, after files.bin was replaced
+        void reload() {
+            std::unique_lock lk{m};
+            f_files.close();
+            files.clear();
+            ids.clear();
+            f_files.open(fn, mmap_type::rw{});
+            files_stream = f_files.get_stream();
+            sync();
+        }
+        // reads paths added by other processes, under the lock
+        void sync() {
+            f_files.refresh();
+            while (auto r = files_stream.read_record()) {
+                path f{std::string{r.record_data()}};
+                ids.emplace(f, files.size());
+                files.emplace_back(f);
+            }
+        }
+        // ids of paths kept in memory by a read only table are taken by paths of others
+        void refresh() {
+            std::unique_lock lk{m};
+            if (fn.empty() || leased || read_only) {
+                return;
+            }
+            std::unique_lock fl{lock};
+            sync();
+        }
+        void flush() {
+            std::unique_lock lk{m};
+            files_writer.flush();
+            if (leased) {
+                lock.unlock();
+                leased = false;
+            }
+        }
+        file_id add(const path &f, bool reset = false) {
+            std::unique_lock lk{m};
+            return add1(f, reset);
+        }
+        file_id add(std::string_view f, bool reset = false) {
+            std::unique_lock lk{m};
+            if (auto it = ids.find(f); it != ids.end()) {
+                if (reset) {
+                    files[it->second].reset();
+                }
+                return it->second;
+            }
+            return add1(path{string{f}}, reset);
+        }
+        file_id add1(const path &f, bool reset) {
+            auto persistent = !fn.empty() && !read_only;
+            if (persistent && !leased && !ids.contains(f)) {
+                lock.lock();
+                leased = true;
+                // it may be added by other process already
+                sync();
+            }
+            auto [it, inserted] = ids.emplace(f, files.size());
+            if (inserted) {
+                if (files.size() == (std::numeric_limits<file_id>::max)()) {
+                    throw std::runtime_error{"too many files in path table"};
+                }
+                files.emplace_back(f);
+                if (persistent) {
+                    mmap_type::record_buffer r;
+                    r << f;
+                    files_writer.add(r);
+                }
             }
             if (reset) {
-                it->second.checked = false;
+                files[it->second].reset();
             }
+            return it->second;
         }
-        void read(auto &&files_stream, auto &&fs) {
-            path f;
-            while (files_stream && files_stream >> f) {
-                auto h = std::hash<decltype(f)>()(f);
-                auto [it,_] = files.emplace(h, f);
-                fs.insert(&it->second);
+        file &operator[](file_id id) {
+            std::shared_lock lk{m};
+            return files[id];
+        }
+        size_t size() {
+            std::shared_lock lk{m};
+            return files.size();
+        }
+        // stat files of this build upfront (no-op builds spend most of the time here),
+        // so outdated checks become pure memory lookups
+        // the table also keeps paths of removed targets and old deps until it is compacted,
+        // they are not touched
+        size_t check_all(std::vector<file_id> ids) {
+            std::ranges::sort(ids);
+            ids.erase(std::ranges::unique(ids).begin(), ids.end());
+            std::vector<file *> unchecked;
+            unchecked.reserve(ids.size());
+            {
+                std::shared_lock lk{m};
+                for (auto id : ids) {
+                    if (id < files.size() && !files[id].checked()) {
+                        unchecked.push_back(&files[id]);
+                    }
+                }
             }
+            parallel_for_each(unchecked, [](auto &&f) {
+                f->check();
+            });
+            return unchecked.size();
         }
-        outdated_reason is_outdated(hash_type fh, const time_point &command_time) const {
-            auto it = global_fs.files.find(fh);
-            if (it == global_fs.files.end()) {
-                return not_recorded_file{};
+        outdated_reason is_outdated(file_id id, const time_point &command_time) {
+            file *f;
+            {
+                std::shared_lock lk{m};
+                if (id >= files.size()) {
+                    return not_recorded_file{};
+                }
+                f = &files[id];
             }
-            return it->second.is_outdated(command_time);
+            return f->is_outdated(command_time);
         }
     };
 
     using mmap_type = mmap_file<>;
 
-    mmap_type f_commands, f_files;
-    mmap_type::stream cmd_stream, files_stream;
+    // bump on format changes
+    static inline constexpr auto db_version = 16;
+    // compact when more than this part of records is superseded by newer ones
+    static inline constexpr auto compaction_garbage_ratio = 0.5;
+    static inline constexpr auto compaction_min_records = 1024;
+    // do not read huge outputs (linked binaries) on every run
+    static inline constexpr auto early_cutoff_max_size = 64 * 1024 * 1024;
+
+    // commands.idx: open addressing table of the latest record offset per command hash
+    // it covers commands.bin up to data_size, newer records are scanned on open
+    struct index_header {
+        uint64_t magic;
+        uint64_t version;
+        // power of 2
+        uint64_t capacity;
+        uint64_t n;
+        uint64_t n_records;
+        uint64_t data_size;
+    };
+    struct index_slot {
+        // empty slot is zero
+        hash_type h;
+        uint64_t offset;
+    };
+    static inline constexpr uint64_t index_magic = 0x7864692d7773; // sw-idx
+    // views point into the mapping and are valid until the next write to the db
+    struct command_view {
+        time_point mtime;
+        clock::duration duration;
+        std::span<const file_id> files;
+        std::span<const output_data> outputs;
+    };
+
+    path dir;
+    mmap_type f_commands;
+    mmap_type::stream cmd_stream;
+    mmap_type::record_writer cmd_writer;
+    mmap_type f_index;
+    const index_header *index{};
+    const index_slot *slots{};
+    // records after the indexed part, hash -> record offset
+    std::unordered_map<hash_type, uint64_t, hash_type::hasher> tail;
+    // end of records that are in the index or in the tail
+    uint64_t scanned_size{};
+    // several sw processes may build from the same dir, appends and compaction are done under this lock
+    file_lock lock;
+    // bumped by compaction, other processes reload the db when it changes
+    uint64_t generation{};
+    // bumped by appends, kept in the next counter of the lock file
+    // processes check it before reading records of others
+    static inline constexpr auto appends_counter = 1;
+    uint64_t appends{};
     static inline file_storage global_fs;
-    std::unordered_set<file_storage::file*> fs;
-    std::unordered_map<hash_type, command_data, hash_type::hasher> commands;
+    // dbs open in this process, path compaction rewrites them in place
+    static inline std::mutex instances_m;
+    static inline std::set<command_storage *> instances;
+    // set when a db was compacted, its dropped records likely referenced paths nobody uses now
+    static inline std::atomic_bool paths_garbage;
+    // used by command hashes
+    path_roots roots;
+    // all records in commands.bin including superseded ones
+    size_t n_records{};
+    // distinct commands
+    size_t n_commands{};
 
     command_storage() = default;
     command_storage(const path &fn) {
         open(fn);
     }
+    ~command_storage() {
+        flush();
+        std::unique_lock lk{instances_m};
+        instances.erase(this);
+    }
+    static path get_db_dir(const path &root) {
+        return root / "db" / std::to_string(db_version);
+    }
     void open(const path &fn) {
-        open1(fn / "db" / "9");
+        open(fn, fn);
+    }
+    // root is a build dir where the shared path table lives
+    void open(const path &fn, const path &root) {
+        global_fs.open(get_db_dir(root));
+        global_fs.register_db(get_db_dir(fn));
+        open1(get_db_dir(fn));
+    }
+    // targets are opened together, records are decoded in parallel
+    // dbs is a range of {command_storage *, dir}
+    // read_only: for build -n, dbs are not compacted and new paths are not written
+    static void open_all(auto &&dbs, const path &root, bool read_only = false) {
+        global_fs.read_only = read_only;
+        global_fs.open(get_db_dir(root));
+        parallel_for_each(dbs, [](auto &&p) {
+            global_fs.register_db(get_db_dir(p.second));
+            p.first->open1(get_db_dir(p.second));
+        }, 1);
     }
     void open1(const path &fn) {
-        f_commands.open(fn / "commands.bin", mmap_type::rw{});
-        f_files.open(fn / "commands.files.bin", mmap_type::rw{});
+        {
+            std::unique_lock lk{instances_m};
+            instances.insert(this);
+        }
+        dir = fn;
+        lock.open(fn / "commands.lock");
+        std::unique_lock lk{lock};
+        load();
+        if (!global_fs.read_only && needs_compaction()) {
+            compact1();
+        }
+    }
+    // under the lock
+    void load() {
+        generation = lock.generation();
+        appends = lock.generation(appends_counter);
+        f_commands.close();
+        f_index.close();
+        f_commands.open(dir / "commands.bin", mmap_type::rw{});
         cmd_stream = f_commands.get_stream();
-        files_stream = f_files.get_stream();
+        cmd_writer.s = &cmd_stream;
+        cmd_writer.write = [this](auto data) {
+            append_records(data);
+        };
+        tail.clear();
+        n_records = n_commands = 0;
+        open_index();
 
+        cmd_stream.offset = scanned_size;
         if (cmd_stream.size() == 0) {
             return;
         }
-        while (auto s = cmd_stream.read_record()) {
+        // only records written after the last index update are read here
+        for (auto start = cmd_stream.offset; auto s = cmd_stream.read_record(); start = cmd_stream.offset) {
             hash_type h;
             s >> h;
-            command_data v;
-            s >> v.mtime;
-            uint64_t n;
-            s >> n;
-            std::ranges::copy(s.make_span<uint64_t>(n), std::inserter(v.files, v.files.end()));
-            commands[h] = v;
+            add_to_tail(h, start);
+            ++n_records;
+        }
+        scanned_size = cmd_stream.offset;
+        if (cmd_stream.torn) {
+            // process was killed in the middle of write, only that command will be rerun
+            log_warn("{}: discarded incomplete record after {} records", dir, n_records);
+        }
+        // from now on only records of checked commands are read, no readahead
+        f_commands.advise(mmap_type::hint::random);
+    }
+    void open_index() {
+        index = nullptr;
+        slots = nullptr;
+        scanned_size = 0;
+        f_index.open(dir / "commands.idx");
+        if (f_index.size() < sizeof(index_header)) {
+            return;
+        }
+        auto h = (const index_header *)f_index.data();
+        if (h->magic != index_magic || h->version != db_version || !std::has_single_bit(h->capacity) ||
+            f_index.size() < sizeof(index_header) + h->capacity * sizeof(index_slot) ||
+            h->data_size > f_commands.size()) {
+            return;
+        }
+        index = h;
+        slots = (const index_slot *)(h + 1);
+        // probes are random, but the whole table is small and hot
+        f_index.advise(mmap_type::hint::will_need);
+        scanned_size = h->data_size;
+        n_records = h->n_records;
+        n_commands = h->n;
+    }
+    std::optional<uint64_t> index_find(const hash_type &h) const {
+        if (!index) {
+            return {};
         }
-        // f_commands.close();
-        // f_commands.open(mmap_type::rw{});
+        auto mask = index->capacity - 1;
+        for (auto i = h.h[0] & mask;; i = (i + 1) & mask) {
+            auto &s = slots[i];
+            if (!s.h) {
+                return {};
+            }
+            if (s.h == h) {
+                return s.offset;
+            }
+        }
+    }
+    std::optional<uint64_t> find_offset(const hash_type &h) const {
+        if (auto it = tail.find(h); it != tail.end()) {
+            return it->second;
+        }
+        return index_find(h);
+    }
+    void add_to_tail(const hash_type &h, uint64_t offset) {
+        auto [it, inserted] = tail.insert_or_assign(h, offset);
+        if (inserted && !index_find(h)) {
+            ++n_commands;
+        }
+    }
+    // record data without header
+    std::span<const uint8_t> record_at(uint64_t offset) const {
+        mmap_type::record_header rh;
+        memcpy(&rh, f_commands.p + offset, sizeof(rh));
+        return {f_commands.p + offset + sizeof(rh), rh.size};
+    }
+    // only pages of this record are touched
+    std::optional<command_view> find(const hash_type &h) const {
+        auto off = find_offset(h);
+        if (!off) {
+            return {};
+        }
+        return view_at(*off);
+    }
+    command_view view_at(uint64_t offset) const {
+        auto r = record_at(offset);
+        auto start = (uint64_t)(r.data() - f_commands.p);
+        mmap_type::stream s{const_cast<mmap_type *>(&f_commands), start};
+        hash_type rh;
+        command_view v;
+        uint64_t n;
+        s >> rh >> v.mtime >> v.duration >> n;
+        v.files = s.make_span<const file_id>(n);
+        s.offset = start + align_record(s.offset - start + n * sizeof(file_id));
+        s >> n;
+        v.outputs = s.make_span<const output_data>(n);
+        return v;
+    }
+    // under the lock: pick up records appended by other processes
+    void sync() {
+        if (lock.generation() != generation) {
+            // compacted by other process
+            load();
+            return;
+        }
+        f_commands.refresh();
+        for (auto start = cmd_stream.offset; auto s = cmd_stream.read_record(); start = cmd_stream.offset) {
+            hash_type h;
+            s >> h;
+            add_to_tail(h, start);
+            ++n_records;
+            // stats of its outputs taken before are stale now
+            auto v = find(h);
+            for (auto &&f : v->files) {
+                if (f < global_fs.size()) {
+                    auto &file = global_fs[f];
+                    file.reset();
+                    stat_cache::global().invalidate(file.f);
+                }
+            }
+        }
+        scanned_size = cmd_stream.offset;
+        appends = lock.generation(appends_counter);
+    }
+    // commands completed by other process are not run again
+    void refresh() {
+        if (dir.empty()) {
+            return;
+        }
+        {
+            std::shared_lock lk{lock};
+            if (lock.generation() == generation && lock.generation(appends_counter) == appends) {
+                return;
+            }
+        }
+        global_fs.refresh();
+        std::unique_lock lk{lock};
+        sync();
+    }
+    void append_records(std::span<const uint8_t> data) {
+        std::unique_lock lk{lock};
+        sync();
+        auto start = cmd_stream.offset;
+        cmd_stream.append(data);
+        lock.set_generation(++appends, appends_counter);
+        for (size_t p = 0; p < data.size();) {
+            mmap_type::record_header rh;
+            hash_type h;
+            memcpy(&rh, data.data() + p, sizeof(rh));
+            memcpy(&h, data.data() + p + sizeof(rh), sizeof(h));
+            add_to_tail(h, start + p);
+            p += sizeof(rh) + rh.size;
+        }
+        scanned_size = cmd_stream.offset;
+    }
+    // rewrite the index when the tail becomes noticeable compared to the whole db
+    void write_index() {
+        auto cap = std::bit_ceil(std::max<uint64_t>(16, n_commands * 2));
+        std::vector<uint8_t> buf(sizeof(index_header) + cap * sizeof(index_slot));
+        auto h = (index_header *)buf.data();
+        auto new_slots = (index_slot *)(h + 1);
+        *h = {index_magic, db_version, cap, 0, n_records, scanned_size};
+        auto insert = [&](const hash_type &k, uint64_t offset) {
+            for (auto i = k.h[0] & (cap - 1);; i = (i + 1) & (cap - 1)) {
+                auto &s = new_slots[i];
+                if (!s.h) {
+                    s = {k, offset};
+                    ++h->n;
+                    return;
+                }
+                if (s.h == k) {
+                    s.offset = offset;
+                    return;
+                }
+            }
+        };
+        if (index) {
+            for (auto &&s : std::span{slots, index->capacity}) {
+                if (s.h) {
+                    insert(s.h, s.offset);
+                }
+            }
+        }
+        for (auto &&[k, offset] : tail) {
+            insert(k, offset);
+        }
+        auto fn = dir / "commands.idx";
+        auto tmp = path{fn} += ".new";
+        {
+            std::ofstream ofile{tmp, std::ios::binary};
+            ofile.write((const char *)buf.data(), buf.size());
+            if (!ofile) {
+                log_warn("cannot write {}", tmp);
+                return;
+            }
+        }
+        f_index.close();
+        fs::rename(tmp, fn);
+        tail.clear();
+        open_index();
+    }
 
-        global_fs.read(files_stream, fs);
+    bool needs_compaction() const {
+        return n_records >= compaction_min_records &&
+               n_records - n_commands > n_records * compaction_garbage_ratio;
+    }
+    // offsets of the latest record of every command
+    void for_each_latest(auto &&f) const {
+        if (index) {
+            for (auto &&sl : std::span{slots, index->capacity}) {
+                if (sl.h && !tail.contains(sl.h)) {
+                    f(sl.offset);
+                }
+            }
+        }
+        for (auto &&[_, offset] : tail) {
+            f(offset);
+        }
+    }
+    // rewrite db with the latest record per command
+    // the path table is compacted separately, see compact_paths()
+    void compact() {
+        if (dir.empty()) {
+            return;
+        }
+        cmd_writer.flush();
+        std::unique_lock lk{lock};
+        sync();
+        compact1();
+    }
+    // under the lock
+    void compact1() {
+        write_compacted([&](auto &w, uint64_t offset) {
+            w.add(record_at(offset));
+        });
+        if (commit_compacted()) {
+            paths_garbage = true;
+        }
+    }
+    // under the lock
+    // writes commands.bin.new, copy(writer, offset) writes the latest record of a command
+    void write_compacted(auto &&copy) {
+        auto tmp_commands = dir / "commands.bin.new";
+        fs::remove(tmp_commands);
+        {
+            mmap_type new_commands{tmp_commands, mmap_type::rw{}};
+            auto s = new_commands.get_stream();
+            mmap_type::record_writer w{s};
+            for_each_latest([&](uint64_t offset) {
+                copy(w, offset);
+            });
+        }
+        // nothing was written, the db becomes empty
+        if (!fs::exists(tmp_commands)) {
+            std::ofstream{tmp_commands};
+        }
+    }
+    // under the lock
+    // replaces commands.bin with commands.bin.new
+    // on failure the new file is kept when the journal of path compaction refers to it
+    bool commit_compacted(bool keep_new = false) {
+        auto fn_commands = dir / "commands.bin";
+        auto tmp_commands = dir / "commands.bin.new";
+        auto n = n_records;
+        f_commands.close();
+        f_index.close();
+        // files mapped by other processes cannot be replaced on windows
+        std::error_code ec;
+        // stale index must not survive
+        if (fs::remove(dir / "commands.idx", ec), !ec) {
+            fs::rename(tmp_commands, fn_commands, ec);
+        }
+        if (ec) {
+            if (!keep_new) {
+                fs::remove(tmp_commands, ec);
+            }
+            load();
+            return false;
+        }
+        lock.set_generation(generation + 1);
+        load();
+        log_debug("compacted {}: {} -> {} records", dir, n, n_records);
+        return true;
+    }
+    // rewrites the path table to paths referenced by the latest records of all dbs using it
+    // and all dbs with the new ids
+    // forced by -compact-db, otherwise it runs after some db was compacted and only when
+    // enough paths are dead; call it after the build, when no ids are kept in memory
+    // other processes keep ids in memory, so it is skipped while they use the table
+    static void compact_paths(bool force) {
+        auto &t = global_fs;
+        if (t.fn.empty() || t.read_only || (!force && !paths_garbage)) {
+            return;
+        }
+        paths_garbage = false;
+        t.flush();
+        if (!t.try_exclusive_use()) {
+            log_debug("{}: used by other processes, not compacted", t.fn);
+            return;
+        }
+        scope_exit se{[&] {
+            t.shared_use();
+        }};
+        std::unique_lock fl{t.lock};
+        {
+            std::unique_lock lk{t.m};
+            t.sync();
+            t.read_dbs();
+        }
+        // dbs of this process and temporary ones for the rest, locks are released before temporaries
+        std::vector<std::unique_ptr<command_storage>> tmp;
+        std::vector<command_storage *> v;
+        {
+            std::unique_lock lk{instances_m};
+            v.assign(instances.begin(), instances.end());
+        }
+        std::set<string> dbs;
+        for (auto s : v) {
+            dbs.insert(s->dir.string());
+        }
+        for (auto &&d : t.dbs) {
+            // removed targets
+            if (dbs.contains(d) || !fs::exists(path{d} / "commands.bin")) {
+                continue;
+            }
+            auto &s = tmp.emplace_back(std::make_unique<command_storage>());
+            s->open1(path{d});
+            v.push_back(s.get());
+            dbs.insert(d);
+        }
+        std::vector<std::unique_lock<file_lock>> locks;
+        for (auto s : v) {
+            s->cmd_writer.flush();
+            locks.emplace_back(s->lock);
+            s->sync();
+        }
+
+        constexpr auto unknown = (std::numeric_limits<file_id>::max)();
+        auto n = (file_id)t.size();
+        std::vector<file_id> ids(n, unknown);
+        auto mark = [&](file_id f) {
+            if (f < n) {
+                ids[f] = 0;
+            }
+        };
+        for (auto s : v) {
+            s->for_each_latest([&](uint64_t offset) {
+                auto cv = s->view_at(offset);
+                std::ranges::for_each(cv.files, mark);
+                for (auto &&o : cv.outputs) {
+                    mark(o.f);
+                }
+            });
+        }
+        file_id live{};
+        for (auto &&id : ids) {
+            if (id != unknown) {
+                id = live++;
+            }
+        }
+        if (!force && (n < compaction_min_records || n - live <= n * compaction_garbage_ratio)) {
+            return;
+        }
+        // ids past the table stay unknown, their commands are outdated as before
+        auto remap = [&](file_id f) {
+            return f < n ? ids[f] : unknown;
+        };
+
+        // new files are written first, then the journal, then they replace the old ones
+        auto tmp_files = path{t.fn} += ".new";
+        fs::remove(tmp_files);
+        {
+            mmap_type nf{tmp_files, mmap_type::rw{}};
+            auto st = nf.get_stream();
+            mmap_type::record_writer w{st};
+            for (file_id i = 0; i < n; ++i) {
+                if (ids[i] != unknown) {
+                    mmap_type::record_buffer r;
+                    r << t[i].f;
+                    w.add(r);
+                }
+            }
+        }
+        if (!fs::exists(tmp_files)) {
+            std::ofstream{tmp_files};
+        }
+        for (auto s : v) {
+            s->write_compacted([&](auto &w, uint64_t offset) {
+                auto cv = s->view_at(offset);
+                hash_type h;
+                memcpy(&h, s->record_at(offset).data(), sizeof(h));
+                command_data d{cv.mtime, cv.duration};
+                for (auto f : cv.files) {
+                    d.files.push_back(remap(f));
+                }
+                for (auto o : cv.outputs) {
+                    o.f = remap(o.f);
+                    d.outputs.push_back(o);
+                }
+                w.add(serialize(h, d));
+            });
+        }
+        string journal;
+        for (auto s : v) {
+            journal += s->dir.string() + "\n";
+        }
+        write_file(t.journal_path(), journal);
+
+        t.f_files.close();
+        fs::rename(tmp_files, t.fn);
+        t.reload();
+        bool ok = true;
+        for (auto s : v) {
+            ok &= s->commit_compacted(true);
+        }
+        if (ok) {
+            fs::remove(t.journal_path());
+        } else {
+            log_warn("{}: some dbs were not replaced, it is finished on the next run", t.fn);
+        }
+        t.dbs = std::move(dbs);
+        t.write_dbs();
+        log_debug("compacted {}: {} -> {} paths", t.fn, n, live);
     }
 
     //
     outdated_reason outdated(auto &cmd, bool explain) const {
-        auto h = cmd.hash();
-        auto cit = commands.find(h);
-        if (cit == commands.end()) {
+        auto v = find(cmd.hash());
+        if (!v) {
             return new_command{&cmd};
         }
-        for (auto &&f : cit->second.files) {
-            if (auto r = global_fs.is_outdated(f, cit->second.mtime); !std::holds_alternative<not_outdated>(r)) {
+        for (auto &&f : v->files) {
+            if (auto r = global_fs.is_outdated(f, v->mtime); !std::holds_alternative<not_outdated>(r)) {
                 return r;
             }
         }
         return {};
     }
+    // recorded run time of the command, empty for new commands
+    std::optional<clock::duration> duration(auto &cmd) const {
+        if (auto v = find(cmd.hash())) {
+            return v->duration;
+        }
+        return {};
+    }
+    // all reasons instead of the first one, for reports
+    std::vector<outdated_reason> outdated_all(auto &cmd) const {
+        auto cv = find(cmd.hash());
+        if (!cv) {
+            return {new_command{&cmd}};
+        }
+        std::vector<outdated_reason> v;
+        for (auto &&f : cv->files) {
+            if (auto r = global_fs.is_outdated(f, cv->mtime); !std::holds_alternative<not_outdated>(r)) {
+                v.push_back(r);
+            }
+        }
+        return v;
+    }
+    // views are spans over the mapping, so sections and whole records are padded with zeros
+    // to alignof(output_data), record headers keep that alignment
+    static uint64_t align_record(uint64_t size) {
+        return (size + alignof(output_data) - 1) / alignof(output_data) * alignof(output_data);
+    }
+    static mmap_type::record_buffer serialize(const hash_type &h, const command_data &v) {
+        static_assert(sizeof(mmap_type::record_header) % alignof(output_data) == 0);
+        uint64_t n = v.files.size();
+        uint64_t nout = v.outputs.size();
+        mmap_type::record_buffer r;
+        r.data.reserve(align_record(sizeof(h) + sizeof(v.mtime) + sizeof(v.duration) + sizeof(n) + n * sizeof(file_id)) +
+                       sizeof(nout) + nout * sizeof(output_data));
+        r << h << v.mtime << v.duration << n;
+        for (auto &&f : v.files) {
+            r << f;
+        }
+        r.data.resize(align_record(r.data.size()));
+        r << nout;
+        // field by field, padding bytes of the struct are not written
+        for (auto &&o : v.outputs) {
+            r << o.f << uint32_t{} << o.mtime << o.digest;
+        }
+        return r;
+    }
+    static std::optional<digest_type> file_digest(const path &fn, uint64_t max_size) {
+        std::error_code ec;
+        auto sz = fs::file_size(fn, ec);
+        if (ec || sz > max_size) {
+            return {};
+        }
+        crypto::shake<128, 128> s;
+        mmap_file<uint8_t>::for_each_window(fn, [&](auto p, auto n) {
+            s.update(p, n);
+        });
+        auto d = s.digest();
+        digest_type r;
+        memcpy(r.data(), d.data(), sizeof(r));
+        return r;
+    }
+    static bool set_mtime(const path &fn, const time_point &t) {
+        std::error_code ec;
+#ifdef _MSC_VER
+        fs::last_write_time(fn, std::chrono::clock_cast<fs::file_time_type::clock>(t), ec);
+#else
+        fs::last_write_time(fn, fs::file_time_type::clock::from_sys(t), ec);
+#endif
+        stat_cache::global().invalidate(fn);
+        return !ec;
+    }
+    // output has the same contents as after the previous run of this command,
+    // keep its old mtime, so dependents stay up to date
+    void early_cutoff(const path &fn, file_id id, output_data &o, const std::optional<command_view> &prev) {
+        if (!prev) {
+            return;
+        }
+        auto it = std::ranges::find(prev->outputs, id, &output_data::f);
+        if (it == prev->outputs.end() || it->digest != o.digest || it->mtime >= o.mtime) {
+            return;
+        }
+        if (!set_mtime(fn, it->mtime)) {
+            return;
+        }
+        o.mtime = it->mtime;
+        global_fs[id].set_mtime(it->mtime);
+        log_trace("output did not change: {}", fn);
+    }
     void add(auto &&cmd) {
-        uint64_t n{0};
-        auto ins = [&](auto &&v, bool reset) {
-            for (auto &&f : v) {
-                global_fs.add(f, files_stream, fs, reset);
+        command_data v;
+        v.mtime = cmd.end;
+        v.files.reserve(cmd.inputs.size() + cmd.implicit_inputs.size() + cmd.implicit_input_ids.size() + cmd.outputs.size());
+        auto ins = [&](auto &&s, bool reset) {
+            for (auto &&f : s) {
+                v.files.push_back(global_fs.add(f, reset));
             }
-            n += v.size();
         };
         ins(cmd.inputs, false);
         ins(cmd.implicit_inputs, false);
+        v.files.insert(v.files.end(), cmd.implicit_input_ids.begin(), cmd.implicit_input_ids.end());
         ins(cmd.outputs, true);
 
         auto h = cmd.hash();
-        auto t = *(uint64_t*)&cmd.end; // on mac it's 128 bit
-        uint64_t sz = sizeof(h) + sizeof(t) + n * sizeof(h) + sizeof(n);
-        auto r = cmd_stream.write_record(sz);
-        r << h << t << n;
-        auto write_h = [&](auto &&v) {
-            for (auto &&f : v) {
-                auto h = (uint64_t)std::hash<path>()(f);
-                r << h;
+        auto prev = find(h);
+        v.duration = cmd.end - cmd.start;
+        // restored from cache, keep the real run time
+        if (v.duration == clock::duration{} && prev) {
+            v.duration = prev->duration;
+        }
+        for (auto &&o : cmd.outputs) {
+            auto id = global_fs.add(o);
+            auto &f = global_fs[id];
+            f.check();
+            if (!f.exists()) {
+                continue;
             }
-        };
-        write_h(cmd.inputs);
-        write_h(cmd.implicit_inputs);
-        write_h(cmd.outputs);
-        // flush
+            auto d = file_digest(o, early_cutoff_max_size);
+            if (!d) {
+                continue;
+            }
+            auto &od = v.outputs.emplace_back(id, f.mtime(), *d);
+            early_cutoff(o, id, od, prev);
+        }
+        // new paths of this command go first, other processes wait for the path table lease
+        global_fs.flush();
+        cmd_writer.add(serialize(h, v));
+        ++n_records;
+    }
+    // path table goes first, so written records never reference unknown ids
+    void flush() {
+        global_fs.flush();
+        cmd_writer.flush();
+        if (dir.empty() || global_fs.read_only) {
+            return;
+        }
+        if (!tail.empty() && tail.size() >= n_commands / 8) {
+            std::unique_lock lk{lock};
+            sync();
+            write_index();
+        }
     }
 };
 
@@ -317,9 +1299,14 @@ if [ $E -ne 0 ]; then echo "Error code: $E"; fi
     using shell_type = variant<shell::cmd, shell::sh>;
 
     bool always{};
+    // outputs do not contain source and binary dirs (-ffile-prefix-map),
+    // so cache keys may replace them with placeholders and be shared between checkouts
+    bool relocatable_outputs{};
     std::set<path> inputs;
     std::set<path> outputs;
     std::set<path> implicit_inputs;
+    // deps scanners intern paths directly
+    std::vector<command_storage::file_id> implicit_input_ids;
     mutable command_storage::hash_type h;
     command_storage::time_point start{}, end;
     command_storage *cs{};
@@ -354,7 +1341,7 @@ if [ $E -ne 0 ]; then echo "Error code: $E"; fi
                     return string{};
                 },
                 [](command_storage::new_command &c) {
-                    return std::format("new command: hash = {}, {}", (size_t)c.c->hash(), c.c->print());
+                    return std::format("new command: hash = {}, {}", c.c->hash().to_string(), c.c->print());
                 },
                 [](command_storage::new_file &f) {
                     return "new file: "s + f.p->string();
@@ -455,7 +1442,7 @@ if [ $E -ne 0 ]; then echo "Error code: $E"; fi
         return "command failed: " + name() + ":\n" + raw_command::get_error_message();
     }
     void save(const path &dir, shell_type t = detect_shell()) {
-        auto fn = dir / std::to_string(hash()) += visit(t,[](auto &&v){return v.extension;});
+        auto fn = dir / hash().to_string() += visit(t,[](auto &&v){return v.extension;});
         string s;
         s += visit(t,[](auto &&v){return v.prolog;});
         s += "echo " + name() + "\n\n";
@@ -677,28 +1664,22 @@ struct gcc_command : io_command {
     void run(auto &&ex) {
         run(ex, [&]{process_deps();});
     }
-    void process_deps() {
-        auto is_space = [](auto c) {
-            return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+    // cheap scan for '.' segments and doubled separators, a leading one is a unc path
+    static bool needs_normalization(string_view fn) {
+        auto sep = [](char c) {
+            return c == '/' || c == '\\';
         };
-        auto add_file = [&](auto sv) {
-            string s;
-            s.reserve(sv.size());
-            for (auto c : sv) {
-                if (c == '\\') {
-                    continue;
-                }
-                s += c;
+        if (fn.starts_with('.')) {
+            return true;
+        }
+        for (size_t i = 1; i < fn.size(); ++i) {
+            if (sep(fn[i - 1]) && (fn[i] == '.' || (i > 1 && sep(fn[i])))) {
+                return true;
             }
-            // we may have 'src/../sw.h' or 'sw4/./sw.h' paths
-            // call absolute? or lexi normal?
-            path p = s;
-#ifndef _WIN32
-            p = p.lexically_normal();
-#endif
-            implicit_inputs.insert(p);
-        };
-
+        }
+        return false;
+    }
+    void process_deps() {
         if (deps_file.empty()) {
             return;
         }
@@ -707,29 +1688,32 @@ struct gcc_command : io_command {
         if (f.sz == 0) {
             throw std::runtime_error{std::format("cannot open deps file: {}", deps_file)};
         }
-        string_view sv{f.p, f.sz};
-        auto p = sv.find(": ");
-        if (p == -1) {
-            throw std::runtime_error{"bad deps file"};
-        }
-        //auto outputs = sv.substr(0, p);
-        auto inputs = sv.substr(p + 2);
-        while (!inputs.empty()) {
-            if (isspace(inputs[0]) || inputs[0] == '\\') {
-                inputs = inputs.substr(1);
-                continue;
-            }
-            for (int i = 0; auto &c : inputs) {
-                if (is_space(c) && *(&c-1) != '\\') {
-                    add_file(inputs.substr(0, i));
-                    inputs = inputs.substr(i);
-                    goto next;
+        implicit_input_ids.clear();
+        // a malformed deps file must not keep the path table lease taken for new paths
+        scope_exit se{[&] {
+            command_storage::global_fs.flush();
+        }};
+        make_deps::parse(string_view{f.p, f.sz}, [&](string_view fn) {
+            // we may have 'src/../sw.h', 'sw4/./sw.h', './sw.h' or 'src//sw.h' paths,
+            // they must get the same ids as normal ones
+            if (needs_normalization(fn)) {
+                path p{string{fn}};
+                p = p.lexically_normal();
+                if (cs) {
+                    implicit_input_ids.push_back(command_storage::global_fs.add(p));
+                } else {
+                    implicit_inputs.insert(p);
                 }
-                ++i;
+                return;
             }
-            add_file(inputs);
-            next:;
-        }
+            // no path objects for known files
+            if (cs) {
+                implicit_input_ids.push_back(command_storage::global_fs.add(fn));
+            } else {
+                implicit_inputs.insert(path{string{fn}});
+            }
+        });
+        se.disable();
     }
 };
 
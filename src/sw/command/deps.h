@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "../sys/string.h"
+
+#include <bit>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+#define SW_DEPS_SSE2
+#endif
+
+namespace sw {
+
+namespace make_deps {
+
+// separators (space, tabs, newlines) and escape chars
+inline bool is_special(char c) {
+    return (unsigned char)c <= ' ' || c == '\\' || c == '$';
+}
+inline size_t find_special(const char *p, size_t n) {
+    size_t i = 0;
+#ifdef SW_DEPS_SSE2
+    const auto space = _mm_set1_epi8(' ');
+    const auto backslash = _mm_set1_epi8('\\');
+    const auto dollar = _mm_set1_epi8('$');
+    for (; i + 16 <= n; i += 16) {
+        auto v = _mm_loadu_si128((const __m128i *)(p + i));
+        // unsigned v <= ' '
+        auto m = _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, backslash));
+        m = _mm_or_si128(m, _mm_cmpeq_epi8(v, dollar));
+        if (auto mask = _mm_movemask_epi8(m)) {
+            return i + (size_t)std::countr_zero((unsigned)mask);
+        }
+    }
+#endif
+    for (; i < n; ++i) {
+        if (is_special(p[i])) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// parses 'target: dep1 dep2' rules written by gcc/clang -MD,
+// long rules are split into lines ending with a backslash
+// calls f(string_view) for every dependency, views point into s or into a temporary buffer
+// for paths with escapes ('\ ', '\#', '$$')
+void parse(string_view s, auto &&f) {
+    auto p = s.find(": ");
+    if (p == string_view::npos) {
+        throw std::runtime_error{"bad deps file"};
+    }
+    s = s.substr(p + 2);
+    auto emit = [&](string_view fn) {
+        // phony targets from -MP
+        if (!fn.empty() && !fn.ends_with(':')) {
+            f(fn);
+        }
+    };
+    string buf;
+    size_t i = 0;
+    while (i < s.size()) {
+        auto c = s[i];
+        if ((unsigned char)c <= ' ') {
+            ++i;
+            continue;
+        }
+        // line continuation
+        if (c == '\\' && i + 1 < s.size() && (s[i + 1] == '\n' || s[i + 1] == '\r')) {
+            ++i;
+            continue;
+        }
+        auto start = i;
+        i += find_special(s.data() + i, s.size() - i);
+        if (i == s.size() || (unsigned char)s[i] <= ' ') {
+            emit(s.substr(start, i - start));
+            continue;
+        }
+        // slow path
+        buf.assign(s.data() + start, i - start);
+        for (; i < s.size(); ++i) {
+            c = s[i];
+            if ((unsigned char)c <= ' ') {
+                break;
+            }
+            if (c == '\\' && i + 1 < s.size()) {
+                auto n = s[i + 1];
+                if (n == '\n' || n == '\r') {
+                    break;
+                }
+                if (n == ' ' || n == '\\' || n == '#') {
+                    buf += n;
+                    ++i;
+                    continue;
+                }
+                // literal backslash (windows paths)
+            } else if (c == '$' && i + 1 < s.size() && s[i + 1] == '$') {
+                ++i;
+            }
+            buf += c;
+        }
+        emit(buf);
+    }
+}
+
+} // namespace make_deps
+
+} // namespace sw
@@ -3,7 +3,8 @@
 
 #pragma once
 
-#include "command.h"
+#include "cache.h"
+#include "explain.h"
 
 namespace sw {
 
@@ -27,11 +28,12 @@ struct command_executor {
         }
     }
     static void make_dependencies(auto &&commands) {
-        std::map<path, void *> cmds;
+        auto &table = command_storage::global_fs;
+        std::unordered_map<command_storage::file_id, void *> cmds;
         for (auto &&c : commands) {
             visit(*c, [&](auto &&c1) {
                 for (auto &&f : c1.outputs) {
-                    auto [_, inserted] = cmds.emplace(f, c);
+                    auto [_, inserted] = cmds.emplace(table.add(f), c);
                     if (!inserted) {
                         throw std::runtime_error{"more than one command produces: "s + f.string()};
                     }
@@ -41,7 +43,7 @@ struct command_executor {
         for (auto &&c : commands) {
             visit(*c, [&](auto &&c1) {
                 for (auto &&f : c1.inputs) {
-                    if (auto i = cmds.find(f); i != cmds.end()) {
+                    if (auto i = cmds.find(table.add(f)); i != cmds.end()) {
                         c1.dependencies.insert(i->second);
                         visit(*(command *)i->second, [&](auto &&d1) {
                             d1.dependents.insert(c);
@@ -118,6 +120,12 @@ struct command_executor {
     std::vector<command*> errors;
     int ignore_errors{0};
     bool explain_outdated{};
+    bool compact_db{};
+    bool dry_run{};
+    std::optional<action_cache> cache;
+    std::optional<outdated_report> report;
+    // outdated by their own inputs, found by evaluate_outdated(), they are not checked again
+    std::unordered_set<void *> outdated_self;
 
     command_executor() {
         init();
@@ -142,7 +150,6 @@ struct command_executor {
         if (c.is_pipe_child()) {
             return;
         }
-        ++command_id;
         auto run_dependents = [&]() {
             for (auto &&d : c.dependents) {
                 visit(*(command *)d, [&](auto &&d1) {
@@ -153,7 +160,31 @@ struct command_executor {
             }
         };
         c.processed = true;
-        if (!c.outdated(explain_outdated)) {
+        // dirty dependencies may have produced the same outputs (early cutoff)
+        if (!outdated_self.contains(cmd) && !c.outdated(explain_outdated)) {
+            --number_of_commands;
+            return run_dependents();
+        }
+        // other sw process building from the same dir may have completed it
+        if (c.cs) {
+            c.cs->refresh();
+            if (!c.outdated(false)) {
+                log_debug("{} (built by other process)", c.name());
+                --number_of_commands;
+                return run_dependents();
+            }
+        }
+        ++command_id;
+        if (report) {
+            report->add(c);
+        }
+        if (cache && cache->restore(c)) {
+            invalidate_outputs(c);
+            log_info("[{}/{}] {} (cached)", command_id, number_of_commands, c.name());
+            c.start = c.end = std::decay_t<decltype(c)>::clock::now();
+            if (c.cs) {
+                c.cs->add(c);
+            }
             return run_dependents();
         }
         log_info("[{}/{}] {}", command_id, number_of_commands, c.name());
@@ -170,6 +201,7 @@ struct command_executor {
 
             c.run(get_executor(), [&, run_dependents, cmd]() {
                 c.end = std::decay_t<decltype(c)>::clock::now();
+                invalidate_outputs(c);
 
                 if (c.simultaneous_jobs) {
                     ++(*c.simultaneous_jobs);
@@ -181,11 +213,17 @@ struct command_executor {
                 }
 
                 if (!c.ok()) {
+                    if (cache) {
+                        cache->invalidate(c);
+                    }
                     errors.push_back(cmd);
                 } else {
                     if constexpr (requires { c.process_deps(); }) {
                         c.process_deps();
                     }
+                    if (cache) {
+                        cache->store(c);
+                    }
                     if (c.cs) {
                         // pipe commands are not added yet - and they must be added when they are finished
                         c.cs->add(c);
@@ -224,24 +262,202 @@ struct command_executor {
             });
         }
     }
-    void run(auto &&cl, auto &&sln) {
-        prepare(cl, sln);
-
-        // initial set of commands
+    // outputs are written by the command, their cached stats are stale (even on failure)
+    static void invalidate_outputs(auto &&c) {
+        for (auto &&o : c.outputs) {
+            stat_cache::global().invalidate(o);
+        }
+    }
+    // files recorded for commands of this build
+    void stat_files() {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<command_storage::file_id> ids;
+        for (auto &&c : external_commands) {
+            visit(*c, [&](auto &&c) {
+                if (!c.cs) {
+                    return;
+                }
+                if (auto v = c.cs->find(c.hash())) {
+                    ids.insert(ids.end(), v->files.begin(), v->files.end());
+                }
+            });
+        }
+        auto n = command_storage::global_fs.check_all(std::move(ids));
+        auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        log_debug("stat of {} files: {:.3f}s", n, t);
+    }
+    // calls f(cmd, c) for all commands, dependencies go first
+    void for_each_in_order(auto &&f) {
+        std::unordered_map<void *, size_t> pending;
+        std::deque<command *> ready;
         for (auto &&c : external_commands) {
             visit(*c, [&](auto &&c1) {
+                pending[c] = c1.dependencies.size();
                 if (c1.dependencies.empty()) {
-                    pending_commands_.push_back(c);
+                    ready.push_back(c);
+                }
+            });
+        }
+        while (!ready.empty()) {
+            auto cmd = ready.front();
+            ready.pop_front();
+            visit(*cmd, [&](auto &&c) {
+                f(cmd, c);
+                for (auto &&d : c.dependents) {
+                    if (!--pending[d]) {
+                        ready.push_back((command *)d);
+                    }
+                }
+            });
+        }
+    }
+    // outdated() of all commands is evaluated in parallel (files are already stat'ed),
+    // then dirty dependencies make their dependents dirty, because their outputs will change
+    std::unordered_map<void *, bool> evaluate_outdated(bool explain) {
+        std::vector<size_t> ids(external_commands.size());
+        std::iota(ids.begin(), ids.end(), 0);
+        std::vector<uint8_t> self(external_commands.size());
+        parallel_for_each(ids, [&](auto i) {
+            visit(*external_commands[i], [&](auto &&c) {
+                self[i] = !c.is_pipe_child() && c.outdated(explain);
+            });
+        }, 16);
+        std::unordered_map<void *, bool> dirty;
+        outdated_self.clear();
+        for (size_t i = 0; i < external_commands.size(); ++i) {
+            dirty[external_commands[i]] = self[i];
+            if (self[i]) {
+                outdated_self.insert(external_commands[i]);
+            }
+        }
+        for_each_in_order([&](auto cmd, auto &&c) {
+            auto &v = dirty[cmd];
+            for (auto &&d : c.dependencies) {
+                v = v || dirty[d];
+            }
+        });
+        return dirty;
+    }
+    // up to date commands are resolved upfront, only the dirty subgraph goes through the scheduler
+    void schedule_outdated() {
+        auto start = std::chrono::steady_clock::now();
+        auto dirty = evaluate_outdated(explain_outdated);
+        number_of_commands = 0;
+        for (auto &&cmd : external_commands) {
+            visit(*cmd, [&](auto &&c) {
+                if (c.is_pipe_child()) {
+                    return;
+                }
+                if (dirty[cmd]) {
+                    ++number_of_commands;
+                    return;
+                }
+                // dependents of up to date commands are either up to date or dirty by other dependencies
+                c.processed = true;
+                for (auto &&d : c.dependents) {
+                    visit(*(command *)d, [&](auto &&d1) {
+                        --d1.n_pending_dependencies;
+                    });
+                }
+            });
+        }
+        for (auto &&cmd : external_commands) {
+            visit(*cmd, [&](auto &&c) {
+                if ((c.is_pipe_child() || dirty[cmd]) && !c.n_pending_dependencies) {
+                    pending_commands_.push_back(cmd);
                 }
             });
         }
+        auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        log_debug("outdated check of {} commands: {:.3f}s, {} to run", external_commands.size(), t, number_of_commands);
+    }
+    // -n: walk the graph in dependency order without running anything
+    void query() {
+        using duration = command_storage::clock::duration;
+        auto dirty = evaluate_outdated(explain_outdated);
+        // on the longest path of dirty commands
+        std::unordered_map<void *, duration> finish;
+        int n{}, unknown{};
+        duration total{}, critical{};
+        for_each_in_order([&](auto cmd, auto &&c) {
+            duration f{};
+            for (auto &&d : c.dependencies) {
+                f = std::max(f, finish[d]);
+            }
+            if (dirty[cmd] && !c.is_pipe_child()) {
+                ++n;
+                log_info("[{}] {}", n, c.name());
+                if (report) {
+                    report->add(c);
+                }
+                if (auto t = c.cs ? c.cs->duration(c) : std::nullopt) {
+                    total += *t;
+                    f += *t;
+                } else {
+                    ++unknown;
+                }
+            }
+            critical = std::max(critical, f);
+            finish[cmd] = f;
+        });
+        auto secs = [](auto d) {
+            return std::chrono::duration<double>(d).count();
+        };
+        log_info("{} of {} commands would run", n, number_of_commands);
+        if (n) {
+            // bounded by the longest chain and by the number of jobs
+            auto est = std::max(critical, total / (int64_t)std::max<size_t>(maximum_running_commands, 1));
+            log_info("estimated time: {:.1f}s ({:.1f}s of cpu time{})", secs(est), secs(total),
+                     unknown ? std::format(", {} commands without recorded time", unknown) : "");
+        }
+    }
+    void run(auto &&cl, auto &&sln) {
+        prepare(cl, sln);
+        if (!cl.rebuild_all) {
+            stat_files();
+        }
+        if (dry_run) {
+            query();
+            write_report(sln);
+            return;
+        }
+
+        schedule_outdated();
         run_next(cl, sln);
         get_executor().run();
+        for (auto &&s : storages()) {
+            s->flush();
+        }
+        // ids of this build are not used anymore
+        command_storage::compact_paths(compact_db);
+        if (cache && (cache->hits || cache->misses)) {
+            log_debug("cache: {} hits, {} misses", cache->hits, cache->misses);
+        }
+        write_report(sln);
+        // next build must see changes made by others
+        auto &sc = stat_cache::global();
+        log_debug("stat cache: {} queries, {} syscalls, {} saved", sc.queries.load(), sc.syscalls.load(),
+                  sc.queries - sc.syscalls);
+        sc.clear();
+    }
+    void write_report(auto &&sln) {
+        if (report) {
+            auto fn = sln.work_dir / "explain_outdated.json";
+            write_file(fn, report->to_json());
+            log_info("outdated report: {}", fn.string());
+        }
     }
     void prepare(auto &&cl, auto &&sln) {
         prepare1(cl, sln);
-        create_output_dirs(external_commands);
+        if (!dry_run) {
+            create_output_dirs(external_commands);
+        }
         make_dependencies(external_commands);
+        // new paths are written and the path table lease is released
+        // dry run keeps them in memory
+        if (!dry_run) {
+            command_storage::global_fs.flush();
+        }
         check_dag(external_commands);
     }
     void prepare1(auto &&cl, auto &&sln) {
@@ -249,6 +465,36 @@ struct command_executor {
             cl.c,
             [&](auto &b) requires requires {b.explain_outdated;} {
             explain_outdated = b.explain_outdated.value;
+            if (explain_outdated) {
+                report.emplace();
+            }
+        });
+        visit_any(
+            cl.c,
+            [&](auto &b) requires requires {b.compact_db;} {
+            compact_db = b.compact_db.value;
+        });
+        visit_any(
+            cl.c,
+            [&](auto &b) requires requires {b.dry_run;} {
+            dry_run = b.dry_run.value;
+        });
+        // the cache is not trimmed, so it is used only when asked for
+        bool use_cache{};
+        visit_any(
+            cl.c,
+            [&](auto &b) requires requires {b.cache;} {
+            use_cache = b.cache || b.remote_cache;
+        });
+        if (!use_cache) {
+            cache.reset();
+        }
+        visit_any(
+            cl.c,
+            [&](auto &b) requires requires {b.remote_cache;} {
+            if (cache && b.remote_cache) {
+                cache->remote.emplace(*b.remote_cache.value);
+            }
         });
         if (cl.jobs) {
             maximum_running_commands = cl.jobs;
@@ -279,6 +525,11 @@ struct command_executor {
                 }
             });
         }
+        if (compact_db && !dry_run) {
+            for (auto &&s : storages()) {
+                s->compact();
+            }
+        }
         for (auto &&c : external_commands) {
             visit(*c, [&](auto &&c) {
                 if (c.is_pipe_leader()) {
@@ -290,6 +541,17 @@ struct command_executor {
             });
         }
     }
+    auto storages() const {
+        std::unordered_set<command_storage *> storages;
+        for (auto &&c : external_commands) {
+            visit(*c, [&](auto &&c) {
+                if (c.cs) {
+                    storages.insert(c.cs);
+                }
+            });
+        }
+        return storages;
+    }
     void check_errors() {
         if (errors.empty()) {
             return;
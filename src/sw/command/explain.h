@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "command.h"
+
+namespace sw {
+
+// json report for -explain-outdated
+// lists all reasons for every command that is run
+// and files that caused rebuilds ranked by number of commands they invalidated
+struct outdated_report {
+    struct reason {
+        string type;
+        path file;
+        command_storage::time_point mtime{}, command_mtime{};
+    };
+    struct entry {
+        string name;
+        string hash;
+        std::vector<reason> reasons;
+        // source files (not outputs of other commands) that made this command outdated
+        std::set<path> root_causes;
+    };
+
+    std::vector<entry> commands;
+    // output -> index in commands
+    std::unordered_map<path, size_t> produced_by;
+
+    void add(auto &&c) {
+        entry e;
+        e.name = c.name();
+        e.hash = c.hash().to_string();
+        auto add_file = [&](auto &&type, auto &&f, auto &&...times) {
+            e.reasons.emplace_back(type, f, times...);
+            if (auto it = produced_by.find(f); it != produced_by.end()) {
+                auto &rc = commands[it->second].root_causes;
+                e.root_causes.insert(rc.begin(), rc.end());
+            } else {
+                e.root_causes.insert(f);
+            }
+        };
+        if (c.always) {
+            e.reasons.emplace_back("always");
+        } else if (!c.cs) {
+            e.reasons.emplace_back("no db");
+        } else {
+            for (auto &&r : c.cs->outdated_all(c)) {
+                visit(
+                    r,
+                    [](command_storage::not_outdated) {
+                    },
+                    [&](command_storage::new_command &) {
+                        e.reasons.emplace_back("new command");
+                    },
+                    [&](command_storage::new_file &f) {
+                        add_file("new file", *f.p);
+                    },
+                    [&](command_storage::not_recorded_file &) {
+                        e.reasons.emplace_back("not recorded file");
+                    },
+                    [&](command_storage::missing_file &f) {
+                        add_file("missing file", *f.p);
+                    },
+                    [&](command_storage::updated_file &f) {
+                        add_file("updated file", *f.p, f.mtime, f.command_mtime);
+                    });
+            }
+        }
+        for (auto &&o : c.outputs) {
+            produced_by[o] = commands.size();
+        }
+        commands.push_back(std::move(e));
+    }
+
+    static auto ns(const command_storage::time_point &t) {
+        return (int64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+    string to_json() const {
+        std::map<path, size_t> counts;
+        size_t new_commands{};
+        for (auto &&e : commands) {
+            for (auto &&f : e.root_causes) {
+                ++counts[f];
+            }
+            new_commands += std::ranges::any_of(e.reasons, [](auto &&r) {
+                return r.type == "new command";
+            });
+        }
+        std::vector<std::pair<path, size_t>> ranked(counts.begin(), counts.end());
+        std::ranges::stable_sort(ranked, std::greater{}, [](auto &&p) {
+            return p.second;
+        });
+
+        json_emitter j;
+        j.begin_object();
+        j.key("total_commands").value(commands.size());
+        j.key("new_commands").value(new_commands);
+        j.key("root_causes").begin_array();
+        for (auto &&[f, n] : ranked) {
+            j.begin_object();
+            j.key("file").value(f.string());
+            j.key("commands").value(n);
+            j.end_object();
+        }
+        j.end_array();
+        j.key("commands").begin_array();
+        for (auto &&e : commands) {
+            j.begin_object();
+            j.key("name").value(e.name);
+            j.key("hash").value(e.hash);
+            j.key("reasons").begin_array();
+            for (auto &&r : e.reasons) {
+                j.begin_object();
+                j.key("type").value(r.type);
+                if (!r.file.empty()) {
+                    j.key("file").value(r.file.string());
+                }
+                if (r.mtime != command_storage::time_point{}) {
+                    j.key("mtime_ns").value(ns(r.mtime));
+                    j.key("command_mtime_ns").value(ns(r.command_mtime));
+                }
+                j.end_object();
+            }
+            j.end_array();
+            j.key("root_causes").begin_array();
+            for (auto &&f : e.root_causes) {
+                j.value(f.string());
+            }
+            j.end_array();
+            j.end_object();
+        }
+        j.end_array();
+        j.end_object();
+        return j.s;
+    }
+};
+
+} // namespace sw
@@ -24,6 +24,7 @@
 #include <limits>
 #include <map>
 #include <mutex>
+#include <numeric>
 #include <ranges>
 #include <regex>
 #include <set>
@@ -203,6 +204,48 @@ void append_vector(auto &&to, auto &&from) {
   }
 }
 
+// runs f over random access range on all cores
+// elements are handed out in small chunks, so uneven work is balanced
+void parallel_for_each(auto &&range, auto &&f, size_t chunk = 64) {
+  const size_t n = std::ranges::size(range);
+  auto nthreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), (n + chunk - 1) / chunk);
+  if (nthreads <= 1) {
+    for (auto &&v : range) {
+      f(v);
+    }
+    return;
+  }
+  std::atomic_size_t next{0};
+  std::exception_ptr eptr;
+  std::mutex m;
+  auto worker = [&]() {
+    try {
+      for (size_t i; (i = next.fetch_add(chunk)) < n;) {
+        for (auto j = i, e = std::min(i + chunk, n); j < e; ++j) {
+          f(range[j]);
+        }
+      }
+    } catch (...) {
+      std::unique_lock lk{m};
+      if (!eptr) {
+        eptr = std::current_exception();
+      }
+      next = n; // stop others
+    }
+  };
+  {
+    std::vector<std::jthread> threads;
+    threads.reserve(nthreads - 1);
+    for (size_t i = 1; i < nthreads; ++i) {
+      threads.emplace_back(worker);
+    }
+    worker();
+  }
+  if (eptr) {
+    std::rethrow_exception(eptr);
+  }
+}
+
 //
 struct any_setting {
   static constexpr auto name = "any_setting"sv;
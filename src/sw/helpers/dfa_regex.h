@@ -0,0 +1,531 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "common.h"
+
+#include <bitset>
+
+namespace sw {
+
+// ecmascript regex subset compiled to a dfa over bytes, full matches only (like std::regex_match)
+// supports literals, escapes, '.', classes, groups, '|', '*', '+', '?', '{m,n}' and lazy quantifiers;
+// anything else (backreferences, assertions, posix classes) makes compile() fail,
+// callers fall back to std::regex then
+// matching costs one table lookup per byte and needs no allocations
+struct dfa_regex {
+    using char_set = std::bitset<256>;
+    using state_type = uint32_t;
+
+    static inline constexpr size_t max_nfa_states = 1 << 14;
+    static inline constexpr size_t max_dfa_states = 1 << 12;
+    static inline constexpr state_type dead = 0;
+
+    // byte -> equivalence class
+    std::array<uint8_t, 256> classes{};
+    size_t nclasses{};
+    // state * nclasses + class -> state
+    std::vector<state_type> table;
+    std::vector<uint8_t> accepting;
+    state_type start{};
+
+    static std::optional<dfa_regex> compile(std::string_view re) {
+        parser p{re, 0, {}};
+        auto root = p.parse();
+        if (!root || !p.at_end()) {
+            return {};
+        }
+        nfa n;
+        auto [s, e] = n.build(p, *root);
+        if (!n.ok) {
+            return {};
+        }
+        n.accept = e;
+        dfa_regex d;
+        if (!d.build(n, s)) {
+            return {};
+        }
+        return d;
+    }
+
+    bool match(std::string_view s) const {
+        auto st = run(s);
+        return accepting[st];
+    }
+    // some continuation of s can still match, used to prune directory walks
+    bool can_match_prefix(std::string_view s) const {
+        return run(s) != dead;
+    }
+
+private:
+    state_type run(std::string_view s) const {
+        auto st = start;
+        for (auto c : s) {
+            st = table[st * nclasses + classes[(uint8_t)c]];
+            if (st == dead) {
+                break;
+            }
+        }
+        return st;
+    }
+
+    struct node {
+        enum kind_type { set, cat, alt, repeat };
+        kind_type kind;
+        char_set cs;
+        std::vector<int> children;
+        // for repeat, max == -1 is unbounded
+        int min{}, max{};
+    };
+
+    struct parser {
+        std::string_view s;
+        size_t i{};
+        std::vector<node> nodes;
+
+        bool at_end() const {
+            return i == s.size();
+        }
+        int add(node n) {
+            nodes.push_back(std::move(n));
+            return nodes.size() - 1;
+        }
+        std::optional<int> parse() {
+            // anchors at the ends are no-ops for full matches
+            if (!at_end() && s[i] == '^') {
+                ++i;
+            }
+            auto r = alt();
+            if (r && !at_end() && s[i] == '$' && i + 1 == s.size()) {
+                ++i;
+            }
+            return r;
+        }
+        std::optional<int> alt() {
+            node n{node::alt, {}, {}};
+            do {
+                auto c = cat();
+                if (!c) {
+                    return {};
+                }
+                n.children.push_back(*c);
+            } while (!at_end() && s[i] == '|' && ++i);
+            return n.children.size() == 1 ? n.children[0] : add(std::move(n));
+        }
+        std::optional<int> cat() {
+            node n{node::cat, {}, {}};
+            while (!at_end() && s[i] != '|' && s[i] != ')' && !(s[i] == '$' && i + 1 == s.size())) {
+                auto a = atom();
+                if (!a) {
+                    return {};
+                }
+                auto q = quantifiers(*a);
+                if (!q) {
+                    return {};
+                }
+                n.children.push_back(*q);
+            }
+            return add(std::move(n));
+        }
+        std::optional<int> quantifiers(int a) {
+            while (!at_end()) {
+                node n{node::repeat, {}, {}};
+                n.children.push_back(a);
+                if (s[i] == '*') {
+                    n.min = 0, n.max = -1;
+                    ++i;
+                } else if (s[i] == '+') {
+                    n.min = 1, n.max = -1;
+                    ++i;
+                } else if (s[i] == '?') {
+                    n.min = 0, n.max = 1;
+                    ++i;
+                } else if (s[i] == '{') {
+                    ++i;
+                    if (!number(n.min)) {
+                        return {};
+                    }
+                    n.max = n.min;
+                    if (!at_end() && s[i] == ',') {
+                        ++i;
+                        n.max = -1;
+                        if (!at_end() && s[i] != '}' && !number(n.max)) {
+                            return {};
+                        }
+                    }
+                    if (at_end() || s[i++] != '}' || (n.max != -1 && n.max < n.min)) {
+                        return {};
+                    }
+                } else {
+                    break;
+                }
+                // laziness does not change whether a full match exists
+                if (!at_end() && s[i] == '?') {
+                    ++i;
+                }
+                a = add(std::move(n));
+            }
+            return a;
+        }
+        bool number(int &n) {
+            auto [p, ec] = std::from_chars(s.data() + i, s.data() + s.size(), n);
+            if (ec != std::errc{} || n > 1000) {
+                return false;
+            }
+            i = p - s.data();
+            return true;
+        }
+        std::optional<int> atom() {
+            auto c = s[i++];
+            switch (c) {
+            case '(': {
+                if (s.substr(i).starts_with("?:")) {
+                    i += 2;
+                } else if (!at_end() && s[i] == '?') {
+                    // lookaheads
+                    return {};
+                }
+                auto r = alt();
+                if (!r || at_end() || s[i++] != ')') {
+                    return {};
+                }
+                return r;
+            }
+            case '[':
+                return char_class();
+            case '.': {
+                node n{node::set, {}, {}};
+                n.cs.set();
+                n.cs.reset('\n');
+                n.cs.reset('\r');
+                return add(std::move(n));
+            }
+            case '\\': {
+                node n{node::set, {}, {}};
+                if (!escape(n.cs)) {
+                    return {};
+                }
+                return add(std::move(n));
+            }
+            case '*': case '+': case '?': case '{': case ')': case '^': case '$':
+                return {};
+            default: {
+                node n{node::set, {}, {}};
+                n.cs.set((uint8_t)c);
+                return add(std::move(n));
+            }
+            }
+        }
+        // after '\'
+        bool escape(char_set &cs) {
+            if (at_end()) {
+                return false;
+            }
+            auto c = s[i++];
+            auto range = [&](char from, char to) {
+                for (int x = (uint8_t)from; x <= (uint8_t)to; ++x) {
+                    cs.set(x);
+                }
+            };
+            switch (c) {
+            case 'd': range('0', '9'); break;
+            case 'D': range('0', '9'); cs.flip(); break;
+            case 'w': range('0', '9'); range('a', 'z'); range('A', 'Z'); cs.set('_'); break;
+            case 'W': range('0', '9'); range('a', 'z'); range('A', 'Z'); cs.set('_'); cs.flip(); break;
+            case 's': for (auto x : " \t\n\r\f\v") { cs.set((uint8_t)x); } cs.reset(0); break;
+            case 'S': for (auto x : " \t\n\r\f\v") { cs.set((uint8_t)x); } cs.reset(0); cs.flip(); break;
+            case 'n': cs.set('\n'); break;
+            case 'r': cs.set('\r'); break;
+            case 't': cs.set('\t'); break;
+            case 'f': cs.set('\f'); break;
+            case 'v': cs.set('\v'); break;
+            case '0': cs.set(0); break;
+            case 'x': {
+                unsigned v{};
+                if (s.size() - i < 2 || std::from_chars(s.data() + i, s.data() + i + 2, v, 16).ptr != s.data() + i + 2) {
+                    return false;
+                }
+                i += 2;
+                cs.set(v);
+                break;
+            }
+            default:
+                // backreferences, word boundaries, unicode escapes
+                if (isalnum((uint8_t)c)) {
+                    return false;
+                }
+                cs.set((uint8_t)c);
+            }
+            return true;
+        }
+        static uint8_t first(const char_set &cs) {
+            for (int x = 0; x < 256; ++x) {
+                if (cs[x]) {
+                    return x;
+                }
+            }
+            return 0;
+        }
+        // after '['
+        std::optional<int> char_class() {
+            node n{node::set, {}, {}};
+            bool negate = !at_end() && s[i] == '^' && ++i;
+            std::optional<uint8_t> prev;
+            while (!at_end() && s[i] != ']') {
+                if (s.substr(i).starts_with("[:") || s.substr(i).starts_with("[=") || s.substr(i).starts_with("[.")) {
+                    return {};
+                }
+                uint8_t c;
+                if (s[i] == '\\') {
+                    ++i;
+                    char_set e;
+                    if (!escape(e)) {
+                        return {};
+                    }
+                    if (e.count() != 1) {
+                        n.cs |= e;
+                        prev.reset();
+                        continue;
+                    }
+                    c = first(e);
+                } else {
+                    c = s[i++];
+                }
+                // range
+                if (prev && c == '-' && !at_end() && s[i] != ']') {
+                    uint8_t to;
+                    if (s[i] == '\\') {
+                        ++i;
+                        char_set e;
+                        if (!escape(e) || e.count() != 1) {
+                            return {};
+                        }
+                        to = first(e);
+                    } else {
+                        to = s[i++];
+                    }
+                    if (to < *prev) {
+                        return {};
+                    }
+                    for (int x = *prev; x <= to; ++x) {
+                        n.cs.set(x);
+                    }
+                    prev.reset();
+                    continue;
+                }
+                n.cs.set(c);
+                prev = c;
+            }
+            if (at_end()) {
+                return {};
+            }
+            ++i;
+            if (negate) {
+                n.cs.flip();
+            }
+            return add(std::move(n));
+        }
+    };
+
+    // thompson construction, states either consume a byte of a set or have epsilon edges
+    struct nfa {
+        struct state {
+            int set{-1};
+            int next{-1};
+            std::vector<int> eps;
+        };
+        std::vector<state> states;
+        std::vector<char_set> sets;
+        int accept{-1};
+        bool ok{true};
+
+        int add() {
+            if (states.size() >= max_nfa_states) {
+                ok = false;
+            }
+            states.emplace_back();
+            return states.size() - 1;
+        }
+        // returns start and end states of the fragment
+        std::pair<int, int> build(const parser &p, int id) {
+            if (!ok) {
+                return {0, 0};
+            }
+            auto &n = p.nodes[id];
+            switch (n.kind) {
+            case node::set: {
+                auto s = add(), e = add();
+                states[s].set = sets.size();
+                states[s].next = e;
+                sets.push_back(n.cs);
+                return {s, e};
+            }
+            case node::cat: {
+                auto s = add();
+                auto e = s;
+                for (auto c : n.children) {
+                    auto [cs, ce] = build(p, c);
+                    states[e].eps.push_back(cs);
+                    e = ce;
+                }
+                return {s, e};
+            }
+            case node::alt: {
+                auto s = add(), e = add();
+                for (auto c : n.children) {
+                    auto [cs, ce] = build(p, c);
+                    states[s].eps.push_back(cs);
+                    states[ce].eps.push_back(e);
+                }
+                return {s, e};
+            }
+            case node::repeat: {
+                auto s = add();
+                auto e = s;
+                for (int k = 0; k < n.min; ++k) {
+                    auto [cs, ce] = build(p, n.children[0]);
+                    states[e].eps.push_back(cs);
+                    e = ce;
+                }
+                if (n.max == -1) {
+                    auto [cs, ce] = build(p, n.children[0]);
+                    auto end = add();
+                    states[e].eps.push_back(cs);
+                    states[e].eps.push_back(end);
+                    states[ce].eps.push_back(cs);
+                    states[ce].eps.push_back(end);
+                    return {s, end};
+                }
+                auto end = add();
+                for (int k = n.min; k < n.max; ++k) {
+                    auto [cs, ce] = build(p, n.children[0]);
+                    states[e].eps.push_back(cs);
+                    states[e].eps.push_back(end);
+                    e = ce;
+                }
+                states[e].eps.push_back(end);
+                return {s, end};
+            }
+            }
+            return {};
+        }
+        void closure(std::vector<int> &set, std::vector<uint8_t> &seen) const {
+            std::ranges::fill(seen, 0);
+            std::vector<int> stack = set;
+            set.clear();
+            while (!stack.empty()) {
+                auto v = stack.back();
+                stack.pop_back();
+                if (seen[v]) {
+                    continue;
+                }
+                seen[v] = 1;
+                // only consuming and accepting states matter for dfa state identity
+                if (states[v].set != -1 || v == accept) {
+                    set.push_back(v);
+                }
+                for (auto e : states[v].eps) {
+                    stack.push_back(e);
+                }
+            }
+            std::ranges::sort(set);
+        }
+    };
+
+    bool build(const nfa &n, int s) {
+        // bytes that no set distinguishes share a class
+        std::map<std::vector<bool>, uint8_t> sigs;
+        for (int b = 0; b < 256; ++b) {
+            std::vector<bool> sig(n.sets.size());
+            for (size_t k = 0; k < n.sets.size(); ++k) {
+                sig[k] = n.sets[k][b];
+            }
+            auto [it, _] = sigs.emplace(std::move(sig), sigs.size());
+            classes[b] = it->second;
+        }
+        nclasses = sigs.size();
+        std::array<uint8_t, 256> repr{};
+        for (int b = 255; b >= 0; --b) {
+            repr[classes[b]] = b;
+        }
+
+        std::vector<uint8_t> seen(n.states.size());
+        std::map<std::vector<int>, state_type> ids;
+        std::vector<std::vector<int>> sets;
+        auto get = [&](std::vector<int> &&v) -> std::optional<state_type> {
+            if (v.empty()) {
+                return dead;
+            }
+            if (auto it = ids.find(v); it != ids.end()) {
+                return it->second;
+            }
+            if (sets.size() >= max_dfa_states) {
+                return {};
+            }
+            auto id = (state_type)sets.size();
+            ids.emplace(v, id);
+            sets.push_back(std::move(v));
+            return id;
+        };
+        sets.emplace_back(); // dead
+        std::vector<int> init{s};
+        n.closure(init, seen);
+        auto st = get(std::move(init));
+        if (!st) {
+            return false;
+        }
+        start = *st;
+        for (size_t i = 0; i < sets.size(); ++i) {
+            table.resize((i + 1) * nclasses);
+            accepting.push_back(std::ranges::binary_search(sets[i], n.accept));
+            for (size_t c = 0; c < nclasses; ++c) {
+                std::vector<int> next;
+                for (auto v : sets[i]) {
+                    auto &ns = n.states[v];
+                    if (ns.set != -1 && n.sets[ns.set][repr[c]]) {
+                        next.push_back(ns.next);
+                    }
+                }
+                n.closure(next, seen);
+                auto t = get(std::move(next));
+                if (!t) {
+                    return false;
+                }
+                table[i * nclasses + c] = *t;
+            }
+        }
+        prune();
+        return true;
+    }
+    // states that cannot reach acceptance behave like dead, so prefix checks are exact
+    void prune() {
+        auto nstates = accepting.size();
+        std::vector<uint8_t> live(accepting.begin(), accepting.end());
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (size_t i = 0; i < nstates; ++i) {
+                if (live[i]) {
+                    continue;
+                }
+                for (size_t c = 0; c < nclasses; ++c) {
+                    if (live[table[i * nclasses + c]]) {
+                        live[i] = 1;
+                        changed = true;
+                        break;
+                    }
+                }
+            }
+        }
+        for (auto &t : table) {
+            if (!live[t]) {
+                t = dead;
+            }
+        }
+        if (!live[start]) {
+            start = dead;
+        }
+    }
+};
+
+} // namespace sw
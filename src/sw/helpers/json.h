@@ -157,4 +157,81 @@ struct json {
     }
 };
 
+// writes reports
+struct json_emitter {
+    string s;
+    // comma is needed before the next value on this level
+    std::vector<bool> has_values{false};
+
+    static string escape(string_view v) {
+        string r;
+        r.reserve(v.size() + 2);
+        r += '\"';
+        for (auto c : v) {
+            switch (c) {
+            case '\"': r += "\\\""; break;
+            case '\\': r += "\\\\"; break;
+            case '\n': r += "\\n"; break;
+            case '\r': r += "\\r"; break;
+            case '\t': r += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    r += std::format("\\u{:04x}", (int)c);
+                } else {
+                    r += c;
+                }
+            }
+        }
+        r += '\"';
+        return r;
+    }
+
+    void next() {
+        if (has_values.back()) {
+            s += ",";
+        }
+        has_values.back() = true;
+    }
+    json_emitter &key(string_view k) {
+        next();
+        s += escape(k) + ":";
+        // value follows without a comma
+        has_values.back() = false;
+        return *this;
+    }
+    void begin(char c) {
+        next();
+        s += c;
+        has_values.push_back(false);
+    }
+    void end(char c) {
+        has_values.pop_back();
+        s += c;
+        has_values.back() = true;
+    }
+    void begin_object() { begin('{'); }
+    void end_object() { end('}'); }
+    void begin_array() { begin('['); }
+    void end_array() { end(']'); }
+    void value(string_view v) {
+        next();
+        s += escape(v);
+    }
+    void value(const char *v) {
+        value(string_view{v});
+    }
+    void value(std::integral auto v) {
+        next();
+        s += std::to_string(v);
+    }
+    void value(bool v) {
+        next();
+        s += v ? "true" : "false";
+    }
+    void value(std::floating_point auto v) {
+        next();
+        s += std::format("{}", v);
+    }
+};
+
 } // namespace sw
@@ -225,7 +225,11 @@ struct rule_target {
                 break;
             }
         }
-        self.cs.open(self.binary_dir);
+        // db itself is opened by the solution for all targets at once
+        self.cs.roots.add(self.source_dir, "${SOURCE_DIR}");
+        self.cs.roots.add(self.binary_dir, "${BINARY_DIR}");
+        self.cs.roots.add(self.sln.binary_dir, "${SOLUTION_BINARY_DIR}");
+        self.cs.roots.add(self.sln.storage_dir, "${STORAGE_DIR}");
         for (auto &&c : self.commands) {
             ::sw::visit(c, [&](auto &&c2) {
                 c2.cs = &self.cs;
@@ -308,10 +312,9 @@ struct target_data : compile_options_t,link_options_t {
 
     void add(const file_regex &r) {
         r(target().source_dir, [&](auto &&iter) {
+            // only regular files are listed
             for (auto &&e : iter) {
-                if (fs::is_regular_file(e)) {
-                    add(e);
-                }
+                add(e.path());
             }
         });
     }
@@ -337,9 +340,7 @@ struct target_data : compile_options_t,link_options_t {
     void remove(const file_regex &r) {
         r(target().source_dir, [&](auto &&iter) {
             for (auto &&e : iter) {
-                if (fs::is_regular_file(e)) {
-                    remove(e);
-                }
+                remove(e.path());
             }
         });
     }
@@ -521,6 +522,9 @@ struct native_target : rule_target, target_data_storage<native_target> {
     string &ApiName{api_name}; // v1 compat
     // internal
     precompiled_header_raw precompiled_header;
+    // remap source and binary dirs in debug info and __FILE__,
+    // so outputs do not depend on the checkout location and can be shared via cache
+    bool relocatable_outputs{};
 
     native_target(auto &&s, auto &&id) : native_target{s, id, raw_target_tag{}} {
         add(make_rule(native_sources_rule{}, [&](auto &&) {
@@ -646,9 +650,9 @@ struct native_target : rule_target, target_data_storage<native_target> {
             return;
 
         if (!from.is_absolute()) {
-            if (fs::exists(SourceDir / from))
+            if (stat_cache::global().exists(SourceDir / from))
                 from = SourceDir / from;
-            else if (fs::exists(bdir / from))
+            else if (stat_cache::global().exists(bdir / from))
                 from = bdir / from;
             else
                 throw std::runtime_error{"Package: "s + getPackage().toString() + ", file not found: " + from.string()};
@@ -785,7 +789,7 @@ struct native_target : rule_target, target_data_storage<native_target> {
         bool source_dir = false;
         path p = fn;
         check_absolute(p, true, &source_dir);
-        if (!fs::exists(p)) {
+        if (!stat_cache::global().exists(p)) {
             if (!p.is_absolute()) {
                 p = BinaryDir / p;
                 source_dir = false;
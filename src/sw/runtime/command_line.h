@@ -201,6 +201,9 @@ struct command_line_parser {
         static constexpr inline auto name = "build"sv;
 
         flag<options::flag<"-explain-outdated"_s>{}> explain_outdated;
+        flag<options::flag<"-compact-db"_s>{}> compact_db;
+        flag<options::flag<"-cache"_s>{}> cache;
+        argument<string, options::flag<"-remote-cache"_s>{}> remote_cache;
         flag<options::flag<"-static"_s>{}> static_;
         flag<options::flag<"-shared"_s>{}> shared;
         flag<options::flag<"-c_static_runtime"_s>{}> c_static_runtime;
@@ -215,7 +218,7 @@ struct command_line_parser {
         argument<string, options::flag<"-target"_s>{}, options::comma_separated_value{}> target;
 
         auto option_list(auto &&...args) {
-            return std::tie(explain_outdated, static_, shared, c_static_runtime, cpp_static_runtime,
+            return std::tie(explain_outdated, compact_db, cache, remote_cache, static_, shared, c_static_runtime, cpp_static_runtime,
                             c_and_cpp_static_runtime, c_and_cpp_dynamic_runtime, arch, config, compiler, os,
                             ignore_errors, target, FWD(args)...);
         }
@@ -231,6 +234,13 @@ struct command_line_parser {
     };
     struct build : build_common {
         static constexpr inline auto name = "build"sv;
+
+        // only report what would be run
+        flag<options::flag<"-n"_s, "-dry-run"_s>{}> dry_run;
+
+        auto option_list() {
+            return build_common::option_list(dry_run);
+        }
     };
     struct override {
         static constexpr inline auto name = "override"sv;
@@ -299,7 +309,19 @@ struct command_line_parser {
     struct setup {
         static constexpr inline auto name = "setup"sv;
     };
-    using command_types = types<build, generate, test, run, exec, setup>;
+    struct cache_server {
+        static constexpr inline auto name = "cache-server"sv;
+
+        // unix:/path or host:port (':port' is loopback), default is unix socket in the storage dir
+        // there is no authentication, do not listen on public interfaces
+        argument<string, options::flag<"-listen"_s>{}> listen;
+        argument<path, options::flag<"-dir"_s>{}> dir;
+
+        auto option_list() {
+            return std::tie(listen, dir);
+        }
+    };
+    using command_types = types<build, generate, test, run, exec, setup, cache_server>;
     using command = command_types::variant_type;
 
     command c;
@@ -139,6 +139,9 @@ struct solution {
   system &sys;
   abspath work_dir;
   abspath binary_dir;
+  path storage_dir;
+  // action cache, empty = disabled
+  path cache_dir;
   const build_settings host_settings_;
   // current, per loaded package data
   path source_dir;
@@ -148,6 +151,8 @@ struct solution {
   // target_map predefined_targets; // or system targets
   std::vector<input_with_settings> inputs;
   bool dry_run = false;
+  // build -n, command dbs are opened read only
+  bool read_only_dbs{};
   input_with_settings current_input;
   std::vector<target_uptr> temp_targets;
 
@@ -238,6 +243,22 @@ struct solution {
         }
       });
     }
+    open_command_storages();
+  }
+  void open_command_storages() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::pair<command_storage *, path>> dbs;
+    for (auto &&[id, t] : targets) {
+      visit(t, [&](auto &&vp) {
+        auto &v = *vp;
+        if constexpr (requires { v.cs; }) {
+          dbs.emplace_back(&v.cs, v.binary_dir);
+        }
+      });
+    }
+    command_storage::open_all(dbs, binary_dir, read_only_dbs);
+    auto t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    log_debug("open of {} command dbs: {:.3f}s", dbs.size(), t);
   }
   auto make_command_executor(bool with_tests = false) {
     load_inputs();
@@ -262,8 +283,13 @@ struct solution {
     build(ex, cl);
   }
   void build(auto &&ex, auto &&cl) {
+    // dbs are opened before the executor reads the command line
+    visit_any(cl.c, [&](auto &b) requires requires { b.dry_run; } { read_only_dbs = b.dry_run.value; });
     auto ce = make_command_executor();
     ce.ex_external = &ex;
+    if (!cache_dir.empty()) {
+      ce.cache.emplace(cache_dir);
+    }
     ce.run(cl, *this);
     ce.check_errors();
     // return ce;
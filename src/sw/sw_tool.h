@@ -49,6 +49,8 @@ struct sw_tool {
       write_file(storfn, (config_dir / "storage").string());
     }
     storage_dir = read_file(config_dir / "storage_dir");
+    executable_index::global().set_dir(storage_dir / "tmp" / "executables");
+    glob_cache::global().dir = storage_dir / "tmp" / "globs";
     temp_dir = temp_sw_directory_path();
     if (!fs::exists(temp_dir)) {
       fs::create_directories(temp_dir);
@@ -90,6 +92,8 @@ exec {} exec -remove-shebang "$@"
   }
   auto make_solution() {
     solution s{sys, sys.binary_dir, default_host_settings()};
+    s.storage_dir = storage_dir;
+    s.cache_dir = storage_dir / "cache";
     return s;
   }
   auto make_inputs(auto &&b) {
@@ -355,6 +359,13 @@ exec {} exec -remove-shebang "$@"
     return c.run();*/
     return 1;
   }
+  int run_command(command_line_parser &cl, command_line_parser::cache_server &b) {
+    path dir = b.dir ? *b.dir.value : storage_dir / "cache";
+    auto address = b.listen ? *b.listen.value : "unix:" + (dir / "server.sock").string();
+    sw::cache_server s{dir};
+    s.run(address);
+    return 0;
+  }
   int run_command(command_line_parser &cl, auto &) { return 1; }
 
   path pkg_root(auto &&name, auto &&version) const { return storage_dir / "pkg" / name / (string)version; }
@@ -0,0 +1,364 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "../helpers/common.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace sw {
+
+// regular file found by directory_walker
+struct walk_entry {
+    sw::path p;
+    // relative part of p starts here
+    size_t root_size;
+
+    const sw::path &path() const {
+        return p;
+    }
+    // '/' separated, relative to the walk root
+    std::string_view relative() const {
+        return std::string_view{p.string()}.substr(root_size);
+    }
+};
+
+// names and types of one directory
+struct directory_listing {
+    struct entry {
+        string name;
+        bool dir;
+    };
+
+    int64_t mtime{};
+    // dirs and regular files (also through symlinks)
+    std::vector<entry> entries;
+};
+
+// listings shared by all globs, reused while the dir mtime stays the same
+// mtimes come from the stat cache, so a dir is listed at most once per build
+struct directory_cache {
+    std::mutex m;
+    std::unordered_map<string, std::shared_ptr<const directory_listing>> listings;
+    std::atomic_size_t reads{};
+    std::atomic_size_t hits{};
+
+    static directory_cache &global() {
+        static directory_cache c;
+        return c;
+    }
+
+    std::shared_ptr<const directory_listing> get(const string &dir) {
+        // taken before reading, so changes during the read are seen next time
+        auto mtime = stat_cache::global().last_write_time(path{dir}).time_since_epoch().count();
+        {
+            std::unique_lock lk{m};
+            if (auto it = listings.find(dir); it != listings.end() && it->second->mtime == mtime) {
+                ++hits;
+                return it->second;
+            }
+        }
+        auto l = std::make_shared<directory_listing>();
+        l->mtime = mtime;
+        read(dir, *l);
+        ++reads;
+        std::unique_lock lk{m};
+        listings.insert_or_assign(dir, l);
+        return l;
+    }
+
+private:
+    // file types come from the listing itself, there is no stat per file
+    // except for symlinks and filesystems without d_type
+    // like fs::recursive_directory_iterator, symlinks to dirs are not followed
+    static void read(const string &dir, directory_listing &l) {
+#ifdef __linux__
+        struct linux_dirent64 {
+            ino64_t d_ino;
+            off64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[];
+        };
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            // unreadable dirs are skipped
+            return;
+        }
+        alignas(linux_dirent64) char buf[32 * 1024];
+        for (;;) {
+            auto n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+            if (n <= 0) {
+                break;
+            }
+            for (long off = 0; off < n;) {
+                auto d = (linux_dirent64 *)(buf + off);
+                off += d->d_reclen;
+                std::string_view name{d->d_name};
+                if (name == "." || name == "..") {
+                    continue;
+                }
+                auto type = d->d_type;
+                if (type == DT_UNKNOWN) {
+                    struct statx stx;
+                    if (::statx(fd, d->d_name, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) != 0) {
+                        continue;
+                    }
+                    type = S_ISREG(stx.stx_mode) ? DT_REG : S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISLNK(stx.stx_mode) ? DT_LNK : DT_UNKNOWN;
+                }
+                if (type == DT_LNK) {
+                    // only links to files are listed
+                    struct statx stx;
+                    if (::statx(fd, d->d_name, 0, STATX_TYPE, &stx) != 0 || !S_ISREG(stx.stx_mode)) {
+                        continue;
+                    }
+                    type = DT_REG;
+                }
+                if (type == DT_REG || type == DT_DIR) {
+                    l.entries.emplace_back(string{name}, type == DT_DIR);
+                }
+            }
+        }
+        ::close(fd);
+#else
+        // entries keep types of the listing (FindNextFile, readdir)
+        std::error_code ec;
+        for (fs::directory_iterator i{path{dir}, ec}, end; !ec && i != end; i.increment(ec)) {
+            auto name = path{i->path()}.filename().string();
+            if (i->is_symlink(ec)) {
+                if (i->is_regular_file(ec)) {
+                    l.entries.emplace_back(name, false);
+                }
+            } else if (i->is_directory(ec)) {
+                l.entries.emplace_back(name, true);
+            } else if (i->is_regular_file(ec)) {
+                l.entries.emplace_back(name, false);
+            }
+        }
+#endif
+    }
+};
+
+// lists regular files under root
+// directories of one level are read in parallel through the directory cache
+// descend(rel) gets 'a/b/' and may prune the subtree, match(rel) filters files,
+// both run on worker threads
+struct directory_walker {
+    struct visited_dir {
+        // relative to root, '' or 'a/b/'
+        string rel;
+        int64_t mtime;
+    };
+
+    path root;
+    bool recursive{true};
+    // every dir that was read, with mtimes of listings used
+    std::vector<visited_dir> dirs;
+
+    std::vector<walk_entry> operator()(auto &&descend, auto &&match) {
+        auto base = root.string();
+        if (!base.ends_with(path::preferred_separator)) {
+            base += path::preferred_separator;
+        }
+        if (!stat_cache::global().is_directory(root)) {
+            throw std::runtime_error{"not a directory: " + root.string()};
+        }
+        std::vector<walk_entry> files;
+        std::vector<string> level{""};
+        while (!level.empty()) {
+            struct result {
+                int64_t mtime;
+                std::vector<string> dirs;
+                std::vector<walk_entry> files;
+            };
+            std::vector<result> results(level.size());
+            parallel_for_each(std::views::iota(size_t{0}, level.size()), [&](auto i) {
+                auto &r = results[i];
+                auto &rel = level[i];
+                auto l = directory_cache::global().get(base + rel);
+                r.mtime = l->mtime;
+                for (auto &&e : l->entries) {
+                    if (e.dir) {
+                        if (recursive) {
+                            auto d = rel + e.name + path::preferred_separator;
+                            if (descend(std::string_view{d})) {
+                                r.dirs.push_back(std::move(d));
+                            }
+                        }
+                    } else if (auto f = rel + e.name; match(std::string_view{f})) {
+                        r.files.push_back(walk_entry{base + f, base.size()});
+                    }
+                }
+            }, 1);
+            for (size_t i = 0; i < level.size(); ++i) {
+                dirs.emplace_back(std::move(level[i]), results[i].mtime);
+            }
+            level.clear();
+            for (auto &&r : results) {
+                std::ranges::move(r.dirs, std::back_inserter(level));
+                std::ranges::move(r.files, std::back_inserter(files));
+            }
+        }
+        return files;
+    }
+};
+
+// glob results kept in memory and on disk between runs,
+// so targets globbing the same tree share one walk and no-op builds do not list dirs
+// a result is valid while all dirs read by its walk keep their mtimes
+// without dir results are kept in memory only
+struct glob_cache {
+    static inline constexpr auto version = 1;
+    // coarsest mtime resolution of common filesystems (fat)
+    static inline constexpr auto mtime_tick = std::chrono::seconds{2};
+
+    struct result {
+        std::vector<walk_entry> files;
+        std::vector<directory_walker::visited_dir> dirs;
+    };
+    using result_ptr = std::shared_ptr<const result>;
+
+    // usually storage_dir/tmp/globs
+    path dir;
+    std::atomic_size_t hits{};
+    std::atomic_size_t loads{};
+    std::atomic_size_t walks{};
+
+    static glob_cache &global() {
+        static glob_cache c;
+        return c;
+    }
+
+    // walk(directory_walker &) is called on misses
+    // the lock of the glob is held during the walk, so concurrent requests for it share one walk,
+    // other globs are not blocked
+    result_ptr get(const path &root, const string &pattern, bool recursive, auto &&walk) {
+        auto key = std::format("{}\n{}\n{}", root.string(), pattern, recursive);
+        auto &e = entry_of(key);
+        std::unique_lock lk{e.m};
+        if (e.r && valid(root, *e.r)) {
+            ++hits;
+            return e.r;
+        }
+        path fn;
+        if (!dir.empty()) {
+            fn = dir / (digest<crypto::sha3<256>>(key).substr(0, 32) + ".txt");
+        }
+        auto r = fn.empty() ? nullptr : load(fn, key, root);
+        if (r && valid(root, *r)) {
+            ++loads;
+        } else {
+            // mtimes are taken before listing
+            auto start = stat_cache::clock::now();
+            directory_walker w{root, recursive, {}};
+            auto nr = std::make_shared<result>();
+            nr->files = walk(w);
+            nr->dirs = std::move(w.dirs);
+            r = nr;
+            ++walks;
+            // it is only a cache
+            if (!fn.empty() && !racy(*r, start)) {
+                try {
+                    write_file(fn, save(key, *r));
+                } catch (std::exception &) {
+                }
+            }
+        }
+        e.r = r;
+        return r;
+    }
+
+private:
+    struct entry {
+        std::mutex m;
+        result_ptr r;
+    };
+    std::mutex m;
+    // nodes are stable, entries live as long as the cache
+    std::unordered_map<string, entry> entries;
+
+    entry &entry_of(const string &key) {
+        std::unique_lock lk{m};
+        return entries[key];
+    }
+    // a dir changed within one mtime tick of the walk may change again with the same mtime,
+    // such results are not saved, so the next run walks again instead of trusting them
+    static bool racy(const result &r, stat_cache::time_point start) {
+        auto limit = (start - mtime_tick).time_since_epoch().count();
+        return std::ranges::any_of(r.dirs, [&](auto &&d) {
+            return d.mtime >= limit;
+        });
+    }
+
+    static string base_of(const path &root) {
+        auto base = root.string();
+        if (!base.ends_with(path::preferred_separator)) {
+            base += path::preferred_separator;
+        }
+        return base;
+    }
+    static bool valid(const path &root, const result &r) {
+        auto base = base_of(root);
+        return std::ranges::all_of(r.dirs, [&](auto &&d) {
+            return stat_cache::global().last_write_time(path{base + d.rel}).time_since_epoch().count() == d.mtime;
+        });
+    }
+    // text, one value per line:
+    // version, key (3 lines), number of files and relative names, number of dirs and relative names with mtimes
+    static string save(const string &key, const result &r) {
+        auto s = std::format("{}\n{}\n{}\n", version, key, r.files.size());
+        for (auto &&f : r.files) {
+            s += std::format("{}\n", f.relative());
+        }
+        s += std::format("{}\n", r.dirs.size());
+        for (auto &&d : r.dirs) {
+            s += std::format("{}\n{}\n", d.rel, d.mtime);
+        }
+        return s;
+    }
+    static result_ptr load(const path &fn, const string &key, const path &root) {
+        auto s = read_file(fn);
+        line_reader lr{s};
+        int ver{};
+        if (!lr.number(ver) || ver != version || !lr.v.starts_with(key + "\n")) {
+            return {};
+        }
+        lr.v.remove_prefix(key.size() + 1);
+        auto base = base_of(root);
+        auto r = std::make_shared<result>();
+        size_t n{};
+        if (!lr.number(n)) {
+            return {};
+        }
+        r->files.reserve(n);
+        while (n--) {
+            auto l = lr.line();
+            if (!l) {
+                return {};
+            }
+            r->files.push_back(walk_entry{base + string{*l}, base.size()});
+        }
+        if (!lr.number(n)) {
+            return {};
+        }
+        r->dirs.reserve(n);
+        while (n--) {
+            auto &d = r->dirs.emplace_back();
+            auto l = lr.line();
+            if (!l || !lr.number(d.mtime)) {
+                return {};
+            }
+            d.rel = *l;
+        }
+        return r;
+    }
+};
+
+} // namespace sw
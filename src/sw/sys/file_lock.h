@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "win32.h"
+#include "../sys/fs.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+namespace sw {
+
+// advisory exclusive lock between processes on a separate lock file
+// meets BasicLockable, use with std::unique_lock
+// not recursive, threads of one process must use their own mutex
+struct file_lock {
+    path fn;
+#ifdef _WIN32
+    win32::handle h;
+#else
+    int fd{-1};
+#endif
+
+    file_lock() = default;
+    file_lock(const path &fn) {
+        open(fn);
+    }
+    file_lock(const file_lock &) = delete;
+    file_lock &operator=(const file_lock &) = delete;
+    ~file_lock() {
+        close();
+    }
+
+    void open(const path &fn) {
+        close();
+        this->fn = fn;
+        fs::create_directories(fn.parent_path());
+#ifdef _WIN32
+        h = win32::handle{CreateFileW(fn.wstring().c_str(), GENERIC_READ | GENERIC_WRITE,
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, 0, OPEN_ALWAYS,
+                                      FILE_ATTRIBUTE_NORMAL, 0),
+                          [&] {
+                              throw win32::winapi_exception{"cannot open lock file: " + fn.string()};
+                          }};
+#else
+        fd = ::open(fn.string().c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error{"cannot open lock file: " + fn.string()};
+        }
+#endif
+    }
+    void close() {
+#ifdef _WIN32
+        h.reset();
+#else
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+    explicit operator bool() const {
+        return !fn.empty();
+    }
+
+    void lock() {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        if (!LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &o)) {
+            throw win32::winapi_exception{"cannot lock file: " + fn.string()};
+        }
+#else
+        while (flock(fd, LOCK_EX) == -1) {
+            if (errno != EINTR) {
+                throw std::runtime_error{"cannot lock file: " + fn.string()};
+            }
+        }
+#endif
+    }
+    // shared with other lock_shared() holders, excludes lock()
+    void lock_shared() {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        if (!LockFileEx(h, 0, 0, MAXDWORD, MAXDWORD, &o)) {
+            throw win32::winapi_exception{"cannot lock file: " + fn.string()};
+        }
+#else
+        while (flock(fd, LOCK_SH) == -1) {
+            if (errno != EINTR) {
+                throw std::runtime_error{"cannot lock file: " + fn.string()};
+            }
+        }
+#endif
+    }
+    bool try_lock() {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        return LockFileEx(h, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, MAXDWORD, MAXDWORD, &o);
+#else
+        return flock(fd, LOCK_EX | LOCK_NB) == 0;
+#endif
+    }
+    void unlock() {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        UnlockFileEx(h, 0, MAXDWORD, MAXDWORD, &o);
+#else
+        flock(fd, LOCK_UN);
+#endif
+    }
+
+    void unlock_shared() {
+        unlock();
+    }
+
+    // counters kept in the lock file, read and written under the lock
+    uint64_t generation(int slot = 0) {
+        uint64_t v{};
+#ifdef _WIN32
+        OVERLAPPED o{};
+        o.Offset = slot * sizeof(v);
+        DWORD n{};
+        if (!ReadFile(h, &v, sizeof(v), &n, &o) || n != sizeof(v)) {
+            return 0;
+        }
+#else
+        if (pread(fd, &v, sizeof(v), slot * sizeof(v)) != sizeof(v)) {
+            return 0;
+        }
+#endif
+        return v;
+    }
+    void set_generation(uint64_t v, int slot = 0) {
+#ifdef _WIN32
+        OVERLAPPED o{};
+        o.Offset = slot * sizeof(v);
+        DWORD n{};
+        if (!WriteFile(h, &v, sizeof(v), &n, &o) || n != sizeof(v)) {
+            throw win32::winapi_exception{"cannot write lock file: " + fn.string()};
+        }
+#else
+        if (pwrite(fd, &v, sizeof(v), slot * sizeof(v)) != sizeof(v)) {
+            throw std::runtime_error{"cannot write lock file: " + fn.string()};
+        }
+#endif
+    }
+};
+
+} // namespace sw
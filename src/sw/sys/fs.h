@@ -1,6 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <filesystem>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
 
 namespace sw {
 
@@ -134,23 +140,105 @@ struct path {
         value += v;
         return *this;
     }
-    auto extension() const {
-        auto fn = value.rfind(preferred_separator) + 1;
-        //SW_UNIMPLEMENTED;
-        return *this;
+    // lexical parts are views into value, no allocations
+    std::string_view filename_view() const {
+        auto v = std::string_view{value};
+        return v.substr(v.rfind(preferred_separator) + 1);
+    }
+    std::string_view extension_view() const {
+        auto fn = filename_view();
+        if (fn == "." || fn == "..") {
+            return {};
+        }
+        auto pos = fn.rfind('.');
+        if (pos == std::string_view::npos || pos == 0) {
+            return {};
+        }
+        return fn.substr(pos);
+    }
+    std::string_view stem_view() const {
+        auto fn = filename_view();
+        return fn.substr(0, fn.size() - extension_view().size());
+    }
+    // length of "/", "C:/", "C:" or "//server/" prefix
+    size_t root_size() const {
+#ifdef _WIN32
+        if (value.size() > 1 && value[1] == ':') {
+            return value.size() > 2 && value[2] == preferred_separator ? 3 : 2;
+        }
+        if (value.size() > 2 && value[0] == preferred_separator && value[1] == preferred_separator &&
+            value[2] != preferred_separator) {
+            auto pos = value.find(preferred_separator, 2);
+            return pos == std::string::npos ? value.size() : pos + 1;
+        }
+#endif
+        return !value.empty() && value[0] == preferred_separator ? 1 : 0;
+    }
+
+    path extension() const {
+        return std::string{extension_view()};
+    }
+    path stem() const {
+        return std::string{stem_view()};
     }
     path filename() const {
-        return value.substr(value.rfind(preferred_separator) + 1);
+        return std::string{filename_view()};
     }
-    auto lexically_normal() const {
-        auto fn = value.rfind(preferred_separator) + 1;
-        //SW_UNIMPLEMENTED;
-        return *this;
+    // same rules as fs::path::lexically_normal() but on our utf8 string
+    path lexically_normal() const {
+        if (value.empty()) {
+            return *this;
+        }
+        auto root = std::string_view{value}.substr(0, root_size());
+        std::vector<std::string_view> parts;
+        bool dir{};
+        for (size_t i = root.size(); i <= value.size();) {
+            auto j = value.find(preferred_separator, i);
+            if (j == std::string::npos) {
+                j = value.size();
+            }
+            auto w = std::string_view{value}.substr(i, j - i);
+            i = j + 1;
+            if (w.empty() || w == ".") {
+                dir = true;
+            } else if (w == "..") {
+                if (!parts.empty() && parts.back() != "..") {
+                    parts.pop_back();
+                    dir = true;
+                } else if (root.empty()) {
+                    parts.push_back(w);
+                    dir = false;
+                }
+            } else {
+                parts.push_back(w);
+                dir = false;
+            }
+        }
+        path p;
+        p.value = root;
+        if (parts.empty()) {
+            if (p.value.empty()) {
+                p.value = ".";
+            }
+            return p;
+        }
+        for (auto &&w : parts) {
+            p.value += w;
+            p.value += preferred_separator;
+        }
+        if (!dir || parts.back() == "..") {
+            p.value.pop_back();
+        }
+        return p;
     }
     path root_path() const {
-        auto fn = value.rfind(preferred_separator) + 1;
-        //SW_UNIMPLEMENTED;
-        return *this;
+        path p;
+        p.value = value.substr(0, root_size());
+        return p;
+    }
+
+    size_t hash() const {
+        return std::hash<std::string_view>{}(value);
     }
 
     auto empty() const { return value.empty(); }
@@ -177,4 +265,67 @@ struct path {
 };
 //using fs::path; // consider our own path
 
+// immutable handle to a path stored once per process
+// copies, comparisons and hashing are O(1), the hash is computed on interning
+// use it as a key in hot maps instead of path
+struct interned_path {
+    struct entry {
+        sw::path p;
+        size_t h;
+    };
+
+    const entry *e{};
+
+    interned_path() = default;
+    interned_path(const path &p) : e{intern(p)} {
+    }
+
+    const path &get() const {
+        static const path empty;
+        return e ? e->p : empty;
+    }
+    operator const path &() const {
+        return get();
+    }
+    const std::string &string() const {
+        return get().string();
+    }
+    auto empty() const {
+        return !e;
+    }
+    size_t hash() const {
+        return e ? e->h : 0;
+    }
+
+    bool operator==(const interned_path &rhs) const {
+        return e == rhs.e;
+    }
+    auto operator<=>(const interned_path &rhs) const {
+        return get() <=> rhs.get();
+    }
+
+private:
+    static const entry *intern(const path &p) {
+        if (p.empty()) {
+            return nullptr;
+        }
+        // sharded to keep parallel prepare from serializing on one mutex
+        struct shard {
+            std::mutex m;
+            std::deque<entry> entries;
+            std::unordered_map<std::string_view, const entry *> index;
+        };
+        static shard shards[16];
+        auto h = p.hash();
+        auto &s = shards[h % std::size(shards)];
+        std::unique_lock lk{s.m};
+        if (auto it = s.index.find(p.string()); it != s.index.end()) {
+            return it->second;
+        }
+        auto &e = s.entries.emplace_back(p, h);
+        s.index.emplace(e.p.string(), &e);
+        return &e;
+    }
+};
+
 } // namespace sw
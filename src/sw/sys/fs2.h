@@ -3,14 +3,22 @@
 #include "../crypto/common.h"
 #include "fs.h"
 #include "mmap.h"
+#include "stat_cache.h"
 
 #include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <format>
 #include <fstream>
+#include <mutex>
 #include <ranges>
 #include <set>
+#include <unordered_map>
 
 #ifndef _WIN32
+#include <fcntl.h>
 #include <pwd.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #endif
@@ -43,30 +51,151 @@ inline path get_home_directory() {
   return home;
 }
 
+// smaller files are read with plain reads, mapping costs more than copying them
+static inline constexpr size_t small_file_size = 64 * 1024;
+
+// missing file reads as empty
 auto read_file(const path &fn) {
-  mmap_file<uint8_t> m{fn};
+#ifndef _WIN32
+  int fd = ::open(fn.string().c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    if (errno == ENOENT) {
+      return std::string{};
+    }
+    throw std::runtime_error{"cannot open file: " + fn.string()};
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    ::close(fd);
+    throw std::runtime_error{"cannot stat file: " + fn.string()};
+  }
+  if ((size_t)st.st_size <= small_file_size) {
+    std::string s(st.st_size, 0);
+    size_t n = 0;
+    while (n < s.size()) {
+      auto r = pread(fd, s.data() + n, s.size() - n, n);
+      if (r == -1 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        ::close(fd);
+        throw std::runtime_error{"cannot read file: " + fn.string()};
+      }
+      n += r;
+    }
+    ::close(fd);
+    return s;
+  }
+  ::close(fd);
+#endif
+  mmap_file<uint8_t> m;
+  m.populate = true;
+  m.open(fn);
   return std::string(m.p, m.p + m.sz);
 }
+// data goes to a temporary file in the same dir which then replaces the target,
+// so readers never see partially written files
+// the replaced file keeps its permissions, symlinks and files with several hard links
+// are written in place, so the links are not broken
 auto write_file(const path &fn, auto &&v) {
-  if (!fs::exists(fn)) {
+  static std::atomic_uint64_t counter;
+#ifdef _WIN32
+  auto pid = GetCurrentProcessId();
+#else
+  auto pid = getpid();
+#endif
+  auto tmp = path{fn} += std::format(".{}.{}.tmp", pid, ++counter);
+#ifdef _WIN32
+  std::error_code ec;
+  auto st = fs::symlink_status(fn.fspath(), ec);
+  auto in_place = st.type() == fs::file_type::symlink;
+  if (auto links = fs::hard_link_count(fn.fspath(), ec); !ec && links > 1) {
+    in_place = true;
+  }
+  auto &out = in_place ? fn : tmp;
+  auto open = [&]() {
+    return std::ofstream{out.fspath(), std::ios::binary};
+  };
+  auto f = open();
+  if (!f) {
     fs::create_directories(fn.parent_path());
-    std::ofstream{fn.fspath()};
+    f = open();
+  }
+  f.write((const char *)v.data(), v.size());
+  f.close();
+  if (!f) {
+    if (!in_place) {
+      fs::remove(tmp);
+    }
+    throw std::runtime_error{"cannot write file: " + fn.string()};
+  }
+  if (!in_place && st.type() == fs::file_type::regular) {
+    fs::permissions(tmp.fspath(), st.permissions(), ec);
+  }
+#else
+  struct stat st;
+  auto exists = ::lstat(fn.string().c_str(), &st) == 0;
+  auto in_place = exists && (S_ISLNK(st.st_mode) || st.st_nlink > 1);
+  auto &out = in_place ? fn : tmp;
+  auto open = [&]() {
+    return ::open(out.string().c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  };
+  // directory usually exists, create it only when needed
+  int fd = open();
+  if (fd == -1 && errno == ENOENT) {
+    fs::create_directories(fn.parent_path());
+    fd = open();
+  }
+  if (fd == -1) {
+    throw std::runtime_error{"cannot create file: " + out.string()};
+  }
+  // not affected by umask
+  if (!in_place && exists && S_ISREG(st.st_mode)) {
+    fchmod(fd, st.st_mode & 07777);
+  }
+  auto p = (const char *)v.data();
+  size_t n = 0;
+  while (n < v.size()) {
+    auto r = pwrite(fd, p + n, v.size() - n, n);
+    if (r == -1 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      ::close(fd);
+      if (!in_place) {
+        ::unlink(tmp.string().c_str());
+      }
+      throw std::runtime_error{"cannot write file: " + fn.string()};
+    }
+    n += r;
   }
-  fs::resize_file(fn, v.size());
-  mmap_file<uint8_t> m{fn, mmap_file<uint8_t>::rw{}};
-  memcpy(m.p, v.data(), v.size());
+  ::close(fd);
+#endif
+  if (!in_place) {
+    // cross device or permission errors must not leave the temporary file behind
+    std::error_code ec;
+    fs::rename(tmp, fn, ec);
+    if (ec) {
+      std::error_code ec2;
+      fs::remove(tmp, ec2);
+      throw fs::filesystem_error{"cannot replace file", tmp, fn, ec};
+    }
+  }
+  // new entry changes the dir too
+  stat_cache::global().invalidate(fn);
+  stat_cache::global().invalidate(fn.parent_path());
 }
 
 template <typename T>
 auto read_file_or_default(const path &fn, T &&default_) {
-  if (!fs::exists(fn)) {
+  if (!stat_cache::global().exists(fn)) {
     return default_;
   }
   return read_file(fn);
 }
 template <typename T>
 auto read_file_or_write_default(const path &fn, T &&default_) {
-  if (!fs::exists(fn)) {
+  if (!stat_cache::global().exists(fn)) {
     write_file(fn, default_);
     return default_;
   }
@@ -139,7 +268,8 @@ void write_file(const path &fn, const string &s = {}) {
 }*/
 
 void write_file_if_different(const path &fn, const string &s) {
-  if (fs::exists(fn) && read_file(fn) == s) {
+  // different size means different contents, no need to read
+  if (auto st = stat_cache::global().get(fn); st.is_regular_file() && st.size == s.size() && read_file(fn) == s) {
     return;
   }
   write_file(fn, s);
@@ -154,51 +284,227 @@ void write_file_once(const path &fn, const string &content, const path &lock_dir
   const auto once = lock_dir / (hf + ".once");
   const auto lock = lock_dir / hf;
 
-  if (!fs::exists(once) || h != read_file(once) || !fs::exists(fn)) {
+  auto &sc = stat_cache::global();
+  if (!sc.exists(once) || h != read_file(once) || !sc.exists(fn)) {
     // ScopedFileLock fl(lock);
     write_file_if_different(fn, content);
     write_file_if_different(once, h);
   }
 }
 
-std::optional<path> resolve_executable(auto &&exe) {
+inline auto temp_sw_directory_path() { return fs::temp_directory_path() / "sw"; }
+
+// reads values of simple line based text files
+struct line_reader {
+  std::string_view v;
+
+  std::optional<std::string_view> line() {
+    auto p = v.find('\n');
+    if (p == std::string_view::npos) {
+      return {};
+    }
+    auto l = v.substr(0, p);
+    v.remove_prefix(p + 1);
+    return l;
+  }
+  bool number(auto &n) {
+    auto l = line();
+    return l && std::from_chars(l->data(), l->data() + l->size(), n).ec == std::errc{};
+  }
+  bool empty() const { return v.empty(); }
+};
+
+// names of files in PATH dirs, read with one directory listing per dir
+// stored on disk per PATH value and reused while dir mtimes stay the same,
+// so probing many compiler names costs hash lookups instead of stat calls
+// without dir the index is kept in memory only
+struct executable_index {
+  static inline constexpr auto version = 1;
 #ifdef _WIN32
-  auto p = getenv("Path"); // use W version?
-  auto delim = ';';
-  auto exts = {".exe", ".bat", ".cmd", ".com"}; // use PATHEXT? it has different order
+  static inline constexpr auto env = "Path"; // use W version?
+  static inline constexpr auto delim = ';';
 #else
-  auto p = getenv("PATH");
-  auto delim = ':';
-  auto exts = {""};
+  static inline constexpr auto env = "PATH";
+  static inline constexpr auto delim = ':';
 #endif
-  if (!p) {
-    return {};
-  }
-  string p2 = p;
-  for (const auto word : std::views::split(p2, delim) | std::views::transform([](auto &&word) {
-                           return std::string_view{word.begin(), word.end()};
-                         })) {
-    auto p = path{word} / exe;
+
+  struct dir {
+    path p;
+    int64_t mtime{};
+    std::vector<string> files;
+  };
+  struct entry {
+    size_t dir;
+    path p;
+  };
+
+  std::mutex m;
+  bool initialized{};
+  // usually storage_dir/tmp/executables
+  path index_dir;
+  path fn;
+  std::vector<dir> dirs;
+  // first occurrence in PATH order
+  std::unordered_map<string, entry> names;
+  size_t scanned{};
+
+  static executable_index &global() {
+    static executable_index i;
+    return i;
+  }
+
+  // before the first lookup
+  void set_dir(const path &d) {
+    std::unique_lock lk{m};
+    index_dir = d;
+  }
+
+  std::optional<path> find(const string &name, auto &&exts) {
+    std::unique_lock lk{m};
+    if (!initialized) {
+      init();
+      initialized = true;
+    }
+    const entry *best{};
     for (auto &e : exts) {
-      if (fs::exists(path{p} += e)) {
-        return path{p} += e;
+      if (auto it = names.find(key(name + e)); it != names.end() && (!best || it->second.dir < best->dir)) {
+        best = &it->second;
       }
     }
+    if (!best) {
+      return {};
+    }
+    return best->p;
   }
-  return {};
+
+private:
+  static string key(string s) {
+#ifdef _WIN32
+    std::ranges::transform(s, s.begin(), ::tolower);
+#endif
+    return s;
+  }
+  static int64_t mtime(const path &d) {
+    return stat_cache::global().last_write_time(d).time_since_epoch().count();
+  }
+
+  void init() {
+    auto e = getenv(env);
+    if (!e) {
+      return;
+    }
+    string pathenv = e;
+    std::vector<path> split;
+    for (auto &&w : std::views::split(pathenv, delim)) {
+      if (auto d = std::string_view{w.begin(), w.end()}; !d.empty()) {
+        split.emplace_back(string{d});
+      }
+    }
+    if (!index_dir.empty()) {
+      fn = index_dir / (digest<crypto::sha3<256>>(pathenv).substr(0, 16) + ".txt");
+    }
+    bool loaded = !fn.empty() && load(pathenv, split);
+    if (!loaded) {
+      dirs.clear();
+      for (auto &&d : split) {
+        dirs.emplace_back(d);
+      }
+    }
+    bool changed = !loaded;
+    for (auto &&d : dirs) {
+      auto t = mtime(d.p);
+      if (!loaded || t != d.mtime) {
+        d.mtime = t;
+        scan(d);
+        changed = true;
+      }
+    }
+    if (changed && !fn.empty()) {
+      // it is only a cache
+      try {
+        write_file(fn, save(pathenv));
+      } catch (std::exception &) {
+      }
+    }
+    for (size_t i = 0; i < dirs.size(); ++i) {
+      for (auto &&f : dirs[i].files) {
+        names.try_emplace(key(f), i, dirs[i].p / f);
+      }
+    }
+  }
+  void scan(dir &d) {
+    ++scanned;
+    d.files.clear();
+    std::error_code ec;
+    for (fs::directory_iterator i{d.p, ec}, end; !ec && i != end; i.increment(ec)) {
+      if (!i->is_directory(ec)) {
+        d.files.push_back(path{i->path()}.filename().string());
+      }
+    }
+  }
+
+  // text, one value per line:
+  // version, PATH, then for every dir: path, mtime, number of files and file names
+  string save(const string &pathenv) const {
+    string s = std::format("{}\n{}\n", version, pathenv);
+    for (auto &&d : dirs) {
+      s += std::format("{}\n{}\n{}\n", d.p.string(), d.mtime, d.files.size());
+      for (auto &&f : d.files) {
+        s += f + "\n";
+      }
+    }
+    return s;
+  }
+  // dirs must be the current PATH in the same order, the file name is only a short hash of it
+  bool load(const string &pathenv, const std::vector<path> &split) {
+    auto s = read_file(fn);
+    line_reader r{s};
+    int ver{};
+    if (!r.number(ver) || ver != version || r.line() != pathenv) {
+      return false;
+    }
+    while (!r.empty()) {
+      auto &d = dirs.emplace_back();
+      size_t n{};
+      auto p = r.line();
+      if (!p || !r.number(d.mtime) || !r.number(n)) {
+        return false;
+      }
+      d.p = string{*p};
+      if (dirs.size() > split.size() || d.p != split[dirs.size() - 1]) {
+        return false;
+      }
+      d.files.reserve(n);
+      while (n--) {
+        auto f = r.line();
+        if (!f) {
+          return false;
+        }
+        d.files.emplace_back(*f);
+      }
+    }
+    return dirs.size() == split.size();
+  }
+};
+
+std::optional<path> resolve_executable(auto &&exe) {
+#ifdef _WIN32
+  auto exts = {".exe", ".bat", ".cmd", ".com"}; // use PATHEXT? it has different order
+#else
+  auto exts = {""};
+#endif
+  return executable_index::global().find(string{exe}, exts);
 }
 
 inline auto is_c_file(const path &fn) {
-  static std::set<string> exts{".c", ".m"}; // with obj-c, separate call?
-  return exts.contains(fn.extension().string());
+  static const std::set<string, std::less<>> exts{".c", ".m"}; // with obj-c, separate call?
+  return exts.contains(fn.extension_view());
 }
 inline auto is_cpp_file(const path &fn) {
-  static std::set<string> exts{".cpp", ".cxx", ".mm"}; // with obj-c++, separate call?
-  return exts.contains(fn.extension().string());
+  static const std::set<string, std::less<>> exts{".cpp", ".cxx", ".mm"}; // with obj-c++, separate call?
+  return exts.contains(fn.extension_view());
 }
 
-inline auto temp_sw_directory_path() { return fs::temp_directory_path() / "sw"; }
-
 } // namespace sw
 
 template <>
@@ -210,16 +516,15 @@ struct std::formatter<sw::path> : formatter<std::string> {
 
 template <>
 struct std::hash<::sw::path> {
-  size_t operator()(const ::sw::path &p) {
-#ifdef _WIN32
-    return std::hash<std::filesystem::path>()(p.fspath());
-#else
-    return std::hash<sw::string>()(p.string());
-#endif
-  }
+  size_t operator()(const ::sw::path &p) const { return p.hash(); }
+};
+
+template <>
+struct std::hash<::sw::interned_path> {
+  size_t operator()(const ::sw::interned_path &p) const { return p.hash(); }
 };
 
 template <>
 struct std::hash<::sw::abspath> {
-  size_t operator()(const ::sw::abspath &p) { return std::hash<sw::path>()(p); }
+  size_t operator()(const ::sw::abspath &p) const { return std::hash<sw::path>()(p); }
 };
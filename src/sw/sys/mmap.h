@@ -8,6 +8,8 @@
 
 #include <fstream>
 #include <span>
+#include <string_view>
+#include <vector>
 #include <cstring>
 
 #ifdef _WIN32
@@ -31,7 +33,8 @@ struct mmap_file {
     };
     struct rw {
         static inline constexpr auto access = GENERIC_READ | GENERIC_WRITE;
-        static inline constexpr auto share_mode = FILE_SHARE_READ;// | FILE_SHARE_WRITE;
+        // several processes append to the same db under a file lock
+        static inline constexpr auto share_mode = FILE_SHARE_READ | FILE_SHARE_WRITE;
         static inline constexpr auto disposition = OPEN_ALWAYS;
         static inline constexpr auto page_mode = PAGE_READWRITE;
         static inline constexpr auto map_mode = FILE_MAP_READ | FILE_MAP_WRITE;
@@ -49,14 +52,29 @@ struct mmap_file {
 
     using size_type = uint64_t;
 
+    // access hints for the mapped range
+    enum class hint {
+        normal,
+        sequential,
+        random,
+        will_need,
+        dont_need,
+    };
+
     path fn;
 #ifdef _WIN32
     win32::handle f, m;
 #else
-    int fd;
+    int fd{-1};
 #endif
     T *p{nullptr};
-    size_type sz;
+    size_type sz{};
+    bool writable{};
+    // prefault pages on open, for files that are read completely
+    bool populate{};
+    // mapping itself, p is inside it for windows not aligned to pages
+    void *base{};
+    size_t mapped{};
 
     mmap_file() = default;
     mmap_file(const path &fn) : fn{fn} {
@@ -65,6 +83,16 @@ struct mmap_file {
     mmap_file(const path &fn, rw v) : fn{fn} {
         open(v);
     }
+    // read only window of a huge file
+    mmap_file(const path &fn, size_type offset, size_type count) : fn{fn} {
+        open_window(offset, count);
+    }
+    mmap_file(const mmap_file &) = delete;
+    mmap_file &operator=(const mmap_file &) = delete;
+    ~mmap_file() {
+        close();
+    }
+
     void open(const path &fn) {
         this->fn = fn;
         open(ro{});
@@ -74,6 +102,8 @@ struct mmap_file {
         open(v);
     }
     void open(auto mode) {
+        close();
+        writable = std::same_as<decltype(mode), rw>;
         sz = !fs::exists(fn) ? 0 : fs::file_size(fn) / sizeof(T);
         if (sz == 0) {
             /*if (!fs::exists(fn)) {
@@ -81,41 +111,143 @@ struct mmap_file {
             }*/
             return;
         }
+        open_file(mode);
+        map(mode, 0, sz * sizeof(T));
+    }
+    // count elements starting from offset, clipped to the file size
+    void open_window(size_type offset, size_type count) {
+        close();
+        writable = false;
+        auto file_sz = !fs::exists(fn) ? 0 : fs::file_size(fn) / sizeof(T);
+        sz = offset >= file_sz ? 0 : std::min(count, file_sz - offset);
+        if (sz == 0) {
+            return;
+        }
+        open_file(ro{});
+        map(ro{}, offset * sizeof(T), sz * sizeof(T));
+    }
+    static size_t granularity() {
+#ifdef _WIN32
+        SYSTEM_INFO si;
+        GetSystemInfo(&si);
+        return si.dwAllocationGranularity;
+#else
+        return sysconf(_SC_PAGESIZE);
+#endif
+    }
+    void open_file(auto mode) {
 #ifdef _WIN32
         f = win32::handle{CreateFileW(fn.wstring().c_str(), mode.access, mode.share_mode, 0, mode.disposition, FILE_ATTRIBUTE_NORMAL, 0),
             [&] { throw win32::winapi_exception{"cannot open file: " + fn.string()}; }};
         m = win32::handle{CreateFileMappingW(f, 0, mode.page_mode, 0, 0, 0),
             [&] { throw win32::winapi_exception{"cannot create file mapping"}; }};
-        p = (T *)MapViewOfFile(m, mode.map_mode, 0, 0, 0);
-        if (!p) {
-            throw win32::winapi_exception{"cannot map file"};
-        }
 #else
-        fd = ::open(fn.string().c_str(), mode.open_mode);
+        fd = ::open(fn.string().c_str(), mode.open_mode | O_CLOEXEC);
         if (fd == -1) {
             throw std::runtime_error{"cannot open file: " + fn.string()};
         }
-        p = (T *)mmap(0, sz, mode.prot_mode, MAP_SHARED, fd, 0);
-        if (p == MAP_FAILED) {
-            ::close(fd);
+#endif
+    }
+    // offset is in bytes and may be unaligned
+    void map(auto mode, size_type offset, size_type len) {
+        auto aligned = offset / granularity() * granularity();
+        mapped = len + (offset - aligned);
+#ifdef _WIN32
+        base = MapViewOfFile(m, mode.map_mode, (DWORD)(aligned >> 32), (DWORD)aligned, mapped);
+        if (!base) {
+            close();
+            throw win32::winapi_exception{"cannot map file"};
+        }
+#else
+        int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if (populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        base = mmap(0, mapped, mode.prot_mode, flags, fd, aligned);
+        if (base == MAP_FAILED) {
+            base = nullptr;
+            close();
             throw std::runtime_error{"cannot create file mapping"};
         }
 #endif
+        p = (T *)((uint8_t *)base + (offset - aligned));
     }
     void close() {
 #ifdef _WIN32
-        if (p) {
-            UnmapViewOfFile(p);
+        if (base) {
+            UnmapViewOfFile(base);
         }
         f.reset();
         m.reset();
 #else
-        ::close(fd);
+        if (base) {
+            munmap(base, mapped);
+        }
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
 #endif
+        base = nullptr;
+        mapped = 0;
+        p = nullptr;
     }
-    ~mmap_file() {
-        close();
+    // offset and len are in elements, len = -1 is up to the end
+    void advise(hint h, size_type offset = 0, size_type len = -1) {
+        if (!p || offset >= sz) {
+            return;
+        }
+        len = std::min(len, sz - offset) * sizeof(T);
+        auto start = (uint8_t *)(p + offset);
+#ifdef _WIN32
+        if (h == hint::will_need) {
+            WIN32_MEMORY_RANGE_ENTRY e{start, len};
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &e, 0);
+        }
+#else
+        auto pg = granularity();
+        auto aligned = (uint8_t *)((uintptr_t)start / pg * pg);
+        int a = MADV_NORMAL;
+        switch (h) {
+        case hint::normal: a = MADV_NORMAL; break;
+        case hint::sequential: a = MADV_SEQUENTIAL; break;
+        case hint::random: a = MADV_RANDOM; break;
+        case hint::will_need: a = MADV_WILLNEED; break;
+        case hint::dont_need: a = MADV_DONTNEED; break;
+        }
+        madvise(aligned, len + (start - aligned), a);
+#endif
+    }
+    // other process may have grown the file
+    void refresh() {
+        auto disk_sz = !fs::exists(fn) ? 0 : fs::file_size(fn) / sizeof(T);
+        if (disk_sz == sz) {
+            return;
+        }
+        if (writable) {
+            open(rw{});
+        } else {
+            open(ro{});
+        }
+    }
+    // maps the file by windows of count elements, calls f(const T *, n)
+    // address space use stays bounded for huge files
+    static inline constexpr size_type default_window = 64 * 1024 * 1024;
+    static void for_each_window(const path &fn, auto &&f, size_type count = default_window) {
+        mmap_file w;
+        w.fn = fn;
+        for (size_type offset = 0;; offset += count) {
+            w.open_window(offset, count);
+            if (!w.sz) {
+                break;
+            }
+            w.advise(hint::sequential);
+            f((const T *)w.p, w.sz);
+        }
     }
+
     auto &operator[](int i) { return p[i]; }
     const auto &operator[](int i) const { return p[i]; }
     bool eof(size_type pos) const { return pos >= sz; }
@@ -129,19 +261,36 @@ struct mmap_file {
     auto size() const {return sz;}
 
     T *alloc(size_type sz) {
-        close();
         auto oldsz = this->sz;
+        auto newsz = oldsz ? oldsz * 2 + sz : sz * 2;
+#if defined(__linux__)
+        // grow in place, pages already mapped are kept
+        if (fd != -1 && base && p == base) {
+            if (ftruncate(fd, newsz * sizeof(T)) == -1) {
+                throw std::runtime_error{"cannot resize file: " + fn.string()};
+            }
+            auto np = mremap(base, mapped, newsz * sizeof(T), MREMAP_MAYMOVE);
+            if (np == MAP_FAILED) {
+                throw std::runtime_error{"cannot remap file: " + fn.string()};
+            }
+            base = np;
+            mapped = newsz * sizeof(T);
+            p = (T *)base;
+            this->sz = newsz;
+            return p + oldsz;
+        }
+#endif
+        close();
         if (!fs::exists(fn)) {
             fs::create_directories(fn.parent_path());
             std::ofstream{fn};
         }
-        fs::resize_file(fn, oldsz ? this->sz * 2 + sz : sz * 2);
+        fs::resize_file(fn, newsz * sizeof(T));
         open(rw{});
         return p + oldsz;
     }
     T *resize(size_type sz) {
      close();
-     auto oldsz = this->sz;
      if (!fs::exists(fn)) {
       fs::create_directories(fn.parent_path());
       std::ofstream{fn};
@@ -151,10 +300,29 @@ struct mmap_file {
      return p;
     }
 
+    // record is: size, checksum, data
+    struct record_header {
+        size_type size;
+        size_type checksum;
+    };
+    static size_type checksum(const void *data, size_type sz) {
+        // fnv1a
+        auto p = (const uint8_t *)data;
+        size_type h = 0xcbf29ce484222325ULL;
+        for (size_type i = 0; i < sz; ++i) {
+            h = (h ^ p[i]) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+
     struct stream {
         mmap_file *m_{};
         size_type offset{0};
         bool ok{true};
+        // data size for streams returned from read_record()
+        size_type record_size{0};
+        // torn record was found at the end (killed writer), it is discarded
+        bool torn{false};
 
         mmap_file &m() const {
             return *m_;
@@ -166,31 +334,42 @@ struct mmap_file {
             return ok && offset != -1 && !m().eof(offset);
         }
 
-        auto write_record(size_type sz) {
-            if (!has_room(sz)) {
-                m().alloc(sz);
+        // appends already prepared bytes (one or more records)
+        void append(std::span<const uint8_t> data) {
+            if (!has_room(data.size())) {
+                m().alloc(data.size());
             }
-            *this << sz;
-            auto oldoff = offset;
-            offset += sz;
-            return stream{m_,oldoff};
+            memcpy(m().p + offset, data.data(), data.size());
+            offset += data.size();
         }
         auto read_record() {
-            size_type sz;
-            if (!has_room(sizeof(sz))) {
+            auto end = [&]() {
                 return stream{m_, (size_type)-1};
+            };
+            record_header h;
+            if (!has_room(sizeof(h))) {
+                return end();
             }
-            *this >> sz;
-            if (sz == 0) {
-                offset -= sizeof(sz);
-                return stream{m_, (size_type)-1};
+            memcpy(&h, m().p + offset, sizeof(h));
+            if (h.size == 0) {
+                return end();
             }
-            if (!has_room(sz)) {
-                return stream{m_, (size_type)-1};
+            auto start = offset + sizeof(h);
+            if (start + h.size > m().sz || checksum(m().p + start, h.size) != h.checksum) {
+                // torn tail, next writes will overwrite it
+                torn = true;
+                if (m().writable) {
+                    memset(m().p + offset, 0, std::min(sizeof(h) + h.size, m().sz - offset));
+                }
+                return end();
             }
-            auto oldoff = offset;
-            offset += sz;
-            return stream{m_,oldoff};
+            offset = start + h.size;
+            auto s = stream{m_, start};
+            s.record_size = h.size;
+            return s;
+        }
+        std::string_view record_data() const {
+            return std::string_view{(const char *)m().p + offset, record_size};
         }
 
         template <typename U>
@@ -202,50 +381,68 @@ struct mmap_file {
             offset += sizeof(U);
             return *this;
         }
+
         template <typename U>
-        stream &operator<<(const U &v) {
-            if (!has_room(sizeof(U))) {
-                m().alloc(sizeof(U));
-            }
-            *(U *)(m().p + offset) = v;
-            offset += sizeof(U);
-            return *this;
+        auto make_span(uint64_t n) {
+            return std::span<U>((U *)(m().p + offset), (U *)(m().p + offset) + n);
         }
+    };
+    // serializes one record in memory
+    struct record_buffer {
+        std::vector<uint8_t> data;
 
-        stream &operator>>(path &p) {
-            auto make_eof = [&, &s = *this]() -> stream& {
-                p.clear();
-                ok = false;
-                return s;
-            };
-            uint64_t len;
-            if (!has_room(sizeof(len))) {
-                return make_eof();
-            }
-            operator>>(len);
-            if (!has_room(len) || len == 0) {
-                offset -= sizeof(len);
-                return make_eof();
-            }
-            p.assign((const char8_t *)m().p + offset, (const char8_t *)m().p + offset + len);
-            offset += len;
+        template <typename U>
+        record_buffer &operator<<(const U &v) requires std::is_trivially_copyable_v<U> {
+            auto p = (const uint8_t *)&v;
+            data.insert(data.end(), p, p + sizeof(U));
             return *this;
         }
-        stream &operator<<(const path &p) {
-            auto s = p.string();
-            uint64_t len = s.size();
-            if (!has_room(len + sizeof(len))) {
-                m().alloc(len + sizeof(len));
-            }
-            operator<<(len);
-            memcpy(m().p + offset, s.data(), len);
-            offset += len;
+        record_buffer &operator<<(const path &p) {
+            auto &s = p.string();
+            data.insert(data.end(), (const uint8_t *)s.data(), (const uint8_t *)s.data() + s.size());
             return *this;
         }
+    };
+    // group commit: records are collected in memory and appended with a single write
+    // and at most one file growth per batch
+    struct record_writer {
+        static inline constexpr size_type max_batch_size = 64 * 1024;
+
+        stream *s{};
+        std::vector<uint8_t> batch;
+        // custom append of a batch, for example under a lock
+        std::function<void(std::span<const uint8_t>)> write;
+
+        record_writer() = default;
+        record_writer(stream &s) : s{&s} {}
+        record_writer(const record_writer &) = delete;
+        record_writer &operator=(const record_writer &) = delete;
+        ~record_writer() {
+            flush();
+        }
 
-        template <typename U>
-        auto make_span(uint64_t n) {
-            return std::span<U>((U *)(m().p + offset), (U *)(m().p + offset) + n);
+        void add(const record_buffer &r) {
+            add(std::span<const uint8_t>{r.data});
+        }
+        void add(std::span<const uint8_t> data) {
+            record_header h{data.size(), checksum(data.data(), data.size())};
+            auto hp = (const uint8_t *)&h;
+            batch.insert(batch.end(), hp, hp + sizeof(h));
+            batch.insert(batch.end(), data.begin(), data.end());
+            if (batch.size() >= max_batch_size) {
+                flush();
+            }
+        }
+        void flush() {
+            if (batch.empty() || (!s && !write)) {
+                return;
+            }
+            if (write) {
+                write(batch);
+            } else {
+                s->append(batch);
+            }
+            batch.clear();
         }
     };
     auto get_stream() {
@@ -0,0 +1,268 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "../helpers/common.h"
+#include "exception.h"
+
+#include <utility>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace sw {
+
+// blocking stream sockets
+// addresses are 'unix:/path/to/socket' or 'host:port', empty host is loopback,
+// use '0.0.0.0:port' or '[::]:port' to listen on all interfaces
+struct socket_stream {
+    int fd{-1};
+    string rbuf;
+
+    socket_stream() = default;
+    explicit socket_stream(int fd) : fd{fd} {}
+    socket_stream(socket_stream &&rhs) noexcept : fd{std::exchange(rhs.fd, -1)}, rbuf{std::move(rhs.rbuf)} {}
+    socket_stream &operator=(socket_stream &&rhs) noexcept {
+        close();
+        fd = std::exchange(rhs.fd, -1);
+        rbuf = std::move(rhs.rbuf);
+        return *this;
+    }
+    ~socket_stream() {
+        close();
+    }
+    void close() {
+#ifndef _WIN32
+        if (fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+#endif
+    }
+    explicit operator bool() const {
+        return fd != -1;
+    }
+
+#ifndef _WIN32
+    // no SOCK_CLOEXEC and MSG_NOSIGNAL on macos
+    static int make_socket(int family) {
+        int fd = ::socket(family, SOCK_STREAM, 0);
+        if (fd != -1) {
+            setup(fd);
+        }
+        return fd;
+    }
+    static void setup(int fd) {
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+    }
+#endif
+
+    // calls f(family, sockaddr *, len) for every address candidate
+    static void resolve(const string &address, auto &&f) {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+        if (address.starts_with("unix:")) {
+            sockaddr_un a{};
+            a.sun_family = AF_UNIX;
+            auto p = address.substr(5);
+            if (p.size() >= sizeof(a.sun_path)) {
+                throw std::runtime_error{"socket path is too long: " + p};
+            }
+            memcpy(a.sun_path, p.data(), p.size());
+            f(AF_UNIX, (sockaddr *)&a, (socklen_t)sizeof(a));
+            return;
+        }
+        auto pos = address.rfind(':');
+        if (pos == string::npos) {
+            throw std::runtime_error{"bad socket address: " + address};
+        }
+        auto host = address.substr(0, pos);
+        auto port = address.substr(pos + 1);
+        if (host.size() > 1 && host.front() == '[' && host.back() == ']') {
+            host = host.substr(1, host.size() - 2);
+        }
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        // no AI_PASSIVE, so empty host gives loopback addresses
+        addrinfo *res;
+        if (auto r = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res)) {
+            throw std::runtime_error{std::format("cannot resolve {}: {}", address, gai_strerror(r))};
+        }
+        scope_exit se{[&] {
+            freeaddrinfo(res);
+        }};
+        for (auto a = res; a; a = a->ai_next) {
+            if (f(a->ai_family, a->ai_addr, a->ai_addrlen)) {
+                return;
+            }
+        }
+#endif
+    }
+    static socket_stream connect(const string &address) {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+        socket_stream s;
+        resolve(address, [&](int family, sockaddr *a, socklen_t len) {
+            int fd = make_socket(family);
+            if (fd == -1) {
+                return false;
+            }
+            if (::connect(fd, a, len) == -1) {
+                ::close(fd);
+                return false;
+            }
+            s = socket_stream{fd};
+            return true;
+        });
+        if (!s) {
+            throw std::runtime_error{"cannot connect to " + address};
+        }
+        return s;
+#endif
+    }
+
+    void write(string_view data) {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+#ifdef MSG_NOSIGNAL
+        constexpr int flags = MSG_NOSIGNAL;
+#else
+        constexpr int flags = 0;
+#endif
+        while (!data.empty()) {
+            auto r = ::send(fd, data.data(), data.size(), flags);
+            if (r == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error{"socket write error"};
+            }
+            data = data.substr(r);
+        }
+#endif
+    }
+    // returns false on eof
+    bool fill() {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+        char buf[64 * 1024];
+        while (true) {
+            auto r = ::recv(fd, buf, sizeof(buf), 0);
+            if (r == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error{"socket read error"};
+            }
+            rbuf.append(buf, r);
+            return r;
+        }
+#endif
+    }
+    // empty optional on eof before the line starts
+    std::optional<string> read_line() {
+        size_t p;
+        while ((p = rbuf.find('\n')) == string::npos) {
+            if (!fill()) {
+                if (rbuf.empty()) {
+                    return {};
+                }
+                throw std::runtime_error{"connection closed"};
+            }
+        }
+        auto l = rbuf.substr(0, p);
+        rbuf.erase(0, p + 1);
+        return l;
+    }
+    string read(size_t n) {
+        while (rbuf.size() < n) {
+            if (!fill()) {
+                throw std::runtime_error{"connection closed"};
+            }
+        }
+        auto s = rbuf.substr(0, n);
+        rbuf.erase(0, n);
+        return s;
+    }
+};
+
+struct socket_listener {
+    int fd{-1};
+    path unix_socket;
+
+    socket_listener(const string &address) {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+        if (address.starts_with("unix:")) {
+            unix_socket = address.substr(5);
+            fs::create_directories(unix_socket.parent_path());
+            fs::remove(unix_socket);
+        }
+        socket_stream::resolve(address, [&](int family, sockaddr *a, socklen_t len) {
+            fd = socket_stream::make_socket(family);
+            if (fd == -1) {
+                return false;
+            }
+            int on = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            if (::bind(fd, a, len) == -1 || ::listen(fd, SOMAXCONN) == -1) {
+                ::close(fd);
+                fd = -1;
+                return false;
+            }
+            return true;
+        });
+        if (fd == -1) {
+            throw std::runtime_error{"cannot listen on " + address};
+        }
+#endif
+    }
+    socket_listener(const socket_listener &) = delete;
+    socket_listener &operator=(const socket_listener &) = delete;
+    ~socket_listener() {
+#ifndef _WIN32
+        if (fd != -1) {
+            ::close(fd);
+        }
+        if (!unix_socket.empty()) {
+            std::error_code ec;
+            fs::remove(unix_socket, ec);
+        }
+#endif
+    }
+    socket_stream accept() {
+#ifdef _WIN32
+        SW_UNIMPLEMENTED;
+#else
+        while (true) {
+            int c = ::accept(fd, nullptr, nullptr);
+            if (c == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                throw std::runtime_error{"accept error"};
+            }
+            socket_stream::setup(c);
+            return socket_stream{c};
+        }
+#endif
+    }
+};
+
+} // namespace sw
@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// Copyright (C) 2022 Egor Pugin <egor.pugin@gmail.com>
+
+#pragma once
+
+#include "fs.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+namespace sw {
+
+// results of stat calls shared by all filesystem queries of one build
+// sw invalidates paths it writes itself, changes made by others are seen after clear()
+struct stat_cache {
+    using clock = std::chrono::system_clock;
+    using time_point = clock::time_point;
+
+    struct info {
+        fs::file_type type{fs::file_type::not_found};
+        time_point mtime{};
+        uint64_t size{};
+
+        bool exists() const {
+            return type != fs::file_type::not_found;
+        }
+        bool is_regular_file() const {
+            return type == fs::file_type::regular;
+        }
+        bool is_directory() const {
+            return type == fs::file_type::directory;
+        }
+    };
+
+    // lookups and real stat calls, the difference is what the cache saved
+    std::atomic_size_t queries{};
+    std::atomic_size_t syscalls{};
+
+    static stat_cache &global() {
+        static stat_cache c;
+        return c;
+    }
+
+    info get(const path &p) {
+        ++queries;
+        interned_path ip{p};
+        auto &s = shard_of(ip);
+        {
+            std::unique_lock lk{s.m};
+            if (auto it = s.entries.find(ip); it != s.entries.end()) {
+                return it->second;
+            }
+        }
+        auto i = stat(p);
+        std::unique_lock lk{s.m};
+        s.entries.insert_or_assign(ip, i);
+        return i;
+    }
+    bool exists(const path &p) {
+        return get(p).exists();
+    }
+    bool is_regular_file(const path &p) {
+        return get(p).is_regular_file();
+    }
+    bool is_directory(const path &p) {
+        return get(p).is_directory();
+    }
+    time_point last_write_time(const path &p) {
+        return get(p).mtime;
+    }
+
+    // call after sw writes, removes or touches the file
+    void invalidate(const path &p) {
+        interned_path ip{p};
+        auto &s = shard_of(ip);
+        std::unique_lock lk{s.m};
+        s.entries.erase(ip);
+    }
+    void clear() {
+        for (auto &&s : shards) {
+            std::unique_lock lk{s.m};
+            s.entries.clear();
+        }
+        queries = 0;
+        syscalls = 0;
+    }
+
+    // one syscall where the platform allows it
+    info stat(const path &p) {
+        ++syscalls;
+        info i;
+#ifdef __linux__
+        struct statx stx;
+        if (::statx(AT_FDCWD, p.string().c_str(), 0, STATX_TYPE | STATX_MTIME | STATX_SIZE, &stx) != 0) {
+            return i;
+        }
+        i.type = S_ISREG(stx.stx_mode)   ? fs::file_type::regular
+                 : S_ISDIR(stx.stx_mode) ? fs::file_type::directory
+                                         : fs::file_type::unknown;
+        i.mtime = time_point{std::chrono::duration_cast<clock::duration>(
+            std::chrono::seconds{stx.stx_mtime.tv_sec} + std::chrono::nanoseconds{stx.stx_mtime.tv_nsec})};
+        i.size = stx.stx_size;
+#else
+        // GetFileAttributesExW
+        std::error_code ec;
+        auto s = fs::status(p, ec);
+        if (ec || !fs::exists(s)) {
+            return i;
+        }
+        i.type = s.type();
+        auto lwt = fs::last_write_time(p, ec);
+        if (!ec) {
+#ifdef _MSC_VER
+            i.mtime = std::chrono::clock_cast<clock>(lwt);
+#else
+            i.mtime = decltype(lwt)::clock::to_sys(lwt);
+#endif
+        }
+        if (i.is_regular_file()) {
+            i.size = fs::file_size(p, ec);
+        }
+#endif
+        return i;
+    }
+
+private:
+    struct hasher {
+        size_t operator()(const interned_path &p) const {
+            return p.hash();
+        }
+    };
+    struct shard {
+        std::mutex m;
+        std::unordered_map<interned_path, info, hasher> entries;
+    };
+    shard shards[16];
+
+    shard &shard_of(const interned_path &p) {
+        return shards[p.hash() % std::size(shards)];
+    }
+};
+
+} // namespace sw
@@ -4,6 +4,8 @@
 #pragma once
 
 #include "helpers/common.h"
+#include "helpers/dfa_regex.h"
+#include "sys/dir_walker.h"
 
 namespace sw {
 
@@ -203,34 +205,56 @@ struct file_regex {
             dir /= s;
         } while (1);
     }
+    // literal start of the regex, dirs that do not agree with it cannot contain matches
+    // used for regexes that dfa_regex does not support
+    static string literal_prefix(std::string_view re) {
+        if (re.contains('|')) {
+            return {};
+        }
+        string p;
+        for (size_t i = 0; i < re.size(); ++i) {
+            auto c = re[i];
+            if (c == '\\' && i + 1 < re.size() && strchr("./-[](){}*+?\\", re[i + 1])) {
+                c = re[++i];
+            } else if (strchr(".[](){}*+?^$\\", c)) {
+                break;
+            }
+            // optional char
+            if (i + 1 < re.size() && strchr("*?{", re[i + 1])) {
+                break;
+            }
+            p += c;
+        }
+        return p;
+    }
     void operator()(auto &&rootdir, auto &&f) const {
         auto &&[root,regex] = extract_dir_regex(str);
         if (root.is_absolute()) {
             throw;
         }
         root = rootdir / root;
-        auto range = [&]<typename Iter>() {
-            return
-                // add caching? yes
-                // add win fast path? yes
-                std::ranges::owning_view{Iter{root}}
-                | std::views::filter([dir = root.string(), r = std::regex{regex}](auto &&el){
-                    auto s = el.path().string();
-                    if (s.starts_with(dir)) {
-                        // eat one more slash
-                        s = s.substr(dir.size() + 1);
-                    } else {
-                        throw;
-                    }
-                    return std::regex_match(s, r);
-                })
-                ;
-        };
-        if (recursive) {
-            f(range.template operator()<fs::recursive_directory_iterator>());
-        } else {
-            f(range.template operator()<fs::directory_iterator>());
-        }
+        auto r = glob_cache::global().get(root, regex, recursive, [&](auto &&walker) {
+            // dfa also tells exactly which dirs cannot contain matches
+            if (auto d = dfa_regex::compile(regex)) {
+                return walker(
+                    [&](std::string_view dir) {
+                        return d->can_match_prefix(dir);
+                    },
+                    [&](std::string_view rel) {
+                        return d->match(rel);
+                    });
+            }
+            auto prefix = literal_prefix(regex);
+            std::regex re{regex};
+            return walker(
+                [&](std::string_view dir) {
+                    return dir.starts_with(prefix) || prefix.starts_with(dir);
+                },
+                [&](std::string_view rel) {
+                    return std::regex_match(rel.begin(), rel.end(), re);
+                });
+        });
+        f(r->files);
     }
 };
 